@@ -0,0 +1,186 @@
+#!/bin/bash
+# Runs the small guest programs below, on every engine where the mode takes one, and checks
+# each run against the reference interpreter (--verify, or the reference engine's debugger
+# transcript) and against its expected output.
+#
+# Usage: tests/run_tests.sh [z16sim binary]   (default: ./z16sim)
+sim=${1:-./z16sim}
+work=$(mktemp -d)
+trap 'rm -rf "$work"' EXIT
+failed=0
+
+# Writes the 16-bit words given as hex arguments to file $1, little-endian.
+image() {
+    local out=$1 word
+    shift
+    : > "$out"
+    for word in "$@"; do
+        printf "\\x${word:2:2}\\x${word:0:2}" >> "$out"
+    done
+}
+
+fail() {
+    echo "FAIL: $*"
+    failed=1
+}
+
+# Self-modifying code: a loop adds 1 to a0 three times, then the program overwrites the
+# loop's addi with "addi a0, 2" and runs the loop again, printing 9.
+image "$work/smc.bin" \
+    01b9 0539 06f9 0381 fec1 e0da ff01 6112 `# 0x00 li a0,0; li s1,2; li s0,3; addi a0,1; addi s0,-1; bnz s0,-4; addi s1,-1; bz s1,+12` \
+    4179 0a0c 0d79 014b 7c35 0047 00c7 0000 `# 0x10 li t1,32; lw t0,0(t1); li t1,6; sw t0,0(t1); j -20; ecall 1; ecall 3` \
+    0581                                    `# 0x20 addi a0,2`
+
+for engine in reference threaded block jit; do
+    for threshold in 1 50; do
+        out=$("$sim" --engine=$engine --jit-threshold=$threshold --trace=none --verify "$work/smc.bin" 2>"$work/err")
+        [ "$out" = "Loaded 34 bytes into memory"$'\n'"9" ] ||
+            fail "smc.bin on $engine (threshold $threshold): $out"
+        [ "$(cat "$work/err")" = "verify: $engine matches reference" ] ||
+            fail "smc.bin on $engine (threshold $threshold): $(cat "$work/err")"
+    done
+done
+
+# Reverse debugging over the same program: break after the rewrite, step back across it
+# and run forward again, with checkpoints every few instructions so restores and engine
+# runs alternate with single steps. Every engine must give the reference transcript.
+printf 'b 0x10\nc\nd\ns 5\nb 0x0C\nc\nr\nsb 8\nr\nrc\nr\nd\nc\nr\nq\n' > "$work/smc.dbg"
+expected=$("$sim" --debug="$work/smc.dbg" --engine=reference --checkpoint-interval=4 "$work/smc.bin" 2>&1)
+case $expected in
+    *"9[33] 0x001C: ecall 3  (halt)"*"a0=0x0009"*) ;;
+    *) fail "smc.bin under --debug on reference: $expected" ;;
+esac
+for engine in threaded block jit; do
+    for threshold in 1 50; do
+        out=$("$sim" --debug="$work/smc.dbg" --engine=$engine --jit-threshold=$threshold \
+              --checkpoint-interval=4 "$work/smc.bin" 2>&1)
+        [ "$out" = "$expected" ] || fail "smc.bin under --debug on $engine (threshold $threshold): $out"
+    done
+done
+
+# Snapshots: stop the same program at several instruction counts (before the rewrite, just
+# after the store, after the jump back, after the print), then restore and finish it on
+# every engine. The final snapshot (registers, PC, instruction count, changed pages) and
+# the output must match an uninterrupted run, and --verify must accept the restored run.
+for engine in reference threaded block jit; do
+    "$sim" --engine=$engine --jit-threshold=1 --trace=none --save-snapshot="$work/full.snap" \
+        "$work/smc.bin" > /dev/null
+    for limit in 5 18 20 32; do
+        first=$("$sim" --engine=reference --trace=none --inst-limit=$limit \
+                --save-snapshot="$work/mid.snap" "$work/smc.bin" 2> /dev/null)
+        rest=$("$sim" --engine=$engine --jit-threshold=1 --trace=none --restore="$work/mid.snap" \
+               --save-snapshot="$work/end.snap" --verify "$work/smc.bin" 2>"$work/err")
+        [ "$(printf '%s\n' "$first" "$rest" | grep -v '^Loaded ' | tr -d '\n')" = 9 ] ||
+            fail "smc.bin restored at $limit on $engine: output $first / $rest"
+        cmp -s "$work/full.snap" "$work/end.snap" ||
+            fail "smc.bin restored at $limit on $engine: final state differs from an uninterrupted run"
+        [ "$(cat "$work/err")" = "verify: $engine matches reference" ] ||
+            fail "smc.bin restored at $limit on $engine: $(cat "$work/err")"
+    done
+done
+
+# Record and replay: a program that echoes each input byte as a number and then prints
+# their sum. The recorded run reads stdin; every engine replays it with stdin closed and
+# must print the same bytes.
+image "$work/echo.bin" \
+    00f9 0087 ac38 0201 4012 0cc0 0047 7e15 `# 0x00 li s0,0; ecall 2; mv t0,a0; addi t0,1; bz t0,+8; add s0,a0; ecall 1; j -12` \
+    a7b8 0047 00c7                          `# 0x10 mv a0,s0; ecall 1; ecall 3`
+printf 'z16' | "$sim" --engine=reference --trace=none --record="$work/echo.log" "$work/echo.bin" > "$work/recorded"
+[ "$(cat "$work/recorded")" = "Loaded 22 bytes into memory"$'\n'"1224954225" ] ||
+    fail "echo.bin under --record: $(cat "$work/recorded")"
+for engine in reference threaded block jit; do
+    "$sim" --engine=$engine --jit-threshold=1 --trace=none --replay="$work/echo.log" "$work/echo.bin" \
+        < /dev/null > "$work/replayed" 2>"$work/err" || fail "echo.bin under --replay on $engine: $(cat "$work/err")"
+    cmp -s "$work/recorded" "$work/replayed" ||
+        fail "echo.bin under --replay on $engine: $(cat "$work/replayed")"
+done
+
+# A log recorded after --restore replays only from that snapshot
+printf 'z' | "$sim" --trace=none --inst-limit=8 --save-snapshot="$work/echo.snap" "$work/echo.bin" > /dev/null 2>&1
+printf '16' | "$sim" --trace=none --restore="$work/echo.snap" --record="$work/echo.log" "$work/echo.bin" \
+    > "$work/recorded"
+[ "$(cat "$work/recorded")" = "Loaded 22 bytes into memory"$'\n'"4954225" ] ||
+    fail "echo.bin under --restore --record: $(cat "$work/recorded")"
+for engine in reference threaded block jit; do
+    "$sim" --engine=$engine --jit-threshold=1 --trace=none --restore="$work/echo.snap" --replay="$work/echo.log" \
+        "$work/echo.bin" < /dev/null > "$work/replayed" 2>"$work/err" &&
+        cmp -s "$work/recorded" "$work/replayed" ||
+        fail "echo.bin under --restore --replay on $engine: $(cat "$work/replayed" "$work/err")"
+    if "$sim" --engine=$engine --trace=none --replay="$work/echo.log" "$work/echo.bin" < /dev/null \
+           > /dev/null 2>"$work/err"; then
+        fail "echo.bin replayed on $engine without the snapshot it was recorded from"
+    fi
+    case $(cat "$work/err") in
+        *"restore the snapshot it was recorded from"*) ;;
+        *) fail "echo.bin replayed on $engine without its snapshot: $(cat "$work/err")" ;;
+    esac
+done
+
+# Coverage: a branch that skips a print at end of input goes one way per run; merging the
+# bitmaps of a run with input and one without must report it taken both ways, in the
+# summary and as two hit BRDA records in the lcov tracefile.
+image "$work/branch.bin" \
+    0087 0381 2192 0047 00c7                `# 0x00 ecall 2; addi a0,1; bz a0,+4; ecall 1; ecall 3`
+printf '0x0000 branch.s:1\n0x0002 branch.s:2\n0x0004 branch.s:3\n0x0006 branch.s:4\n0x0008 branch.s:6\n' \
+    > "$work/branch.map"
+for engine in reference threaded block jit; do
+    "$sim" --engine=$engine --trace=none --coverage="$work/eof.cov" --coverage-report="$work/eof.txt" \
+        "$work/branch.bin" < /dev/null > /dev/null
+    printf 'x' | "$sim" --engine=$engine --trace=none --coverage="$work/byte.cov" \
+        --coverage-report="$work/byte.txt" "$work/branch.bin" > /dev/null
+    grep -q "0x0004  taken only " "$work/eof.txt" || fail "branch.bin coverage on $engine: $(cat "$work/eof.txt")"
+    grep -q "0x0004  not taken only " "$work/byte.txt" ||
+        fail "branch.bin coverage on $engine: $(cat "$work/byte.txt")"
+    "$sim" --coverage="$work/merged.cov" --coverage-report="$work/merged.txt" --line-map="$work/branch.map" \
+        --lcov="$work/merged.info" --coverage-merge "$work/branch.bin" "$work/eof.cov" "$work/byte.cov" ||
+        fail "--coverage-merge of branch.bin runs on $engine failed"
+    grep -q "^Coverage: 5 instructions executed" "$work/merged.txt" &&
+        grep -q "^Branches: 1 executed, 1 both ways, 0 one way only" "$work/merged.txt" ||
+        fail "branch.bin merged coverage on $engine: $(cat "$work/merged.txt")"
+    [ "$(grep -E '^(DA:4|BRDA|BRH)' "$work/merged.info" | tr '\n' ' ')" = "DA:4,1 BRDA:3,0,0,1 BRDA:3,0,1,1 BRH:2 " ] ||
+        fail "branch.bin merged lcov on $engine: $(cat "$work/merged.info")"
+done
+
+# Batch mode: a manifest naming a missing image still runs the others and lists every
+# image in manifest order, but exits nonzero.
+printf '# batch test\n%s\n%s\n\n%s\n%s\n' "$work/smc.bin" "$work/missing.bin" "$work/branch.bin" \
+    "$work/smc.bin" > "$work/manifest"
+expected=$(printf '# image\texit\tinstructions\toutput_bytes\toutput_fnv1a\n'
+           printf '%s\thalt\t33\t1\t44bd62d473cd550e\n' "$work/smc.bin"
+           printf '%s\tload-error\t0\t0\t-\n' "$work/missing.bin"
+           printf '%s\thalt\t4\t0\t14650fb0739d0383\n' "$work/branch.bin"
+           printf '%s\thalt\t33\t1\t44bd62d473cd550e\n' "$work/smc.bin")
+for engine in reference threaded block jit; do
+    for jobs in 1 3; do
+        out=$("$sim" --engine=$engine --jit-threshold=1 --jobs=$jobs --batch "$work/manifest" 2>"$work/err")
+        status=$?
+        [ "$out" = "$expected" ] || fail "--batch on $engine ($jobs jobs): $out"
+        [ $status = 1 ] || fail "--batch with a missing image on $engine ($jobs jobs) exited with $status"
+        grep -q "(1 failed to load)" "$work/err" || fail "--batch on $engine ($jobs jobs): $(cat "$work/err")"
+    done
+done
+grep -v missing "$work/manifest" > "$work/manifest.ok"
+"$sim" --batch "$work/manifest.ok" > /dev/null 2>&1 || fail "--batch with every image present exited with $?"
+
+# Fuzz replay: the input length picks the outcome. An empty input runs a loop whose back
+# edge is taken 256 times (its edge counter must not wrap to zero) and halts, one byte
+# spins until the instruction limit, two bytes reach an illegal instruction.
+image "$work/fuzz.bin" \
+    5192 ff81 2192 f000 0005 0239 3019 0201 `# 0x00 bz a0,+10; addi a0,-1; bz a0,+4; illegal; j 0; li t0,1; slli t0,8; addi t0,1` \
+    fe01 f01a 00c7                          `# 0x10 addi t0,-1; bnz t0,-2; ecall 3`
+: > "$work/ok.in"
+printf 'h' > "$work/hang.in"
+printf 'cc' > "$work/crash.in"
+out=$("$sim" --inst-limit=5000 --fuzz "$work/fuzz.bin" "$work/ok.in" "$work/hang.in" "$work/crash.in" 2>"$work/err")
+status=$?
+[ "$out" = "$(printf '%s\tok\t519\n%s\thang\t5000\n%s\tcrash\t4' "$work/ok.in" "$work/hang.in" "$work/crash.in")" ] ||
+    fail "--fuzz replay: $out"
+[ $status = 1 ] || fail "--fuzz replay with a crashing input exited with $status"
+grep -q "^fuzz: 3 inputs, 7 edges covered" "$work/err" || fail "--fuzz replay: $(cat "$work/err")"
+"$sim" --inst-limit=5000 --fuzz "$work/fuzz.bin" "$work/ok.in" "$work/hang.in" > /dev/null 2>"$work/err" ||
+    fail "--fuzz replay without a crashing input exited with $?"
+"$sim" --fuzz "$work/fuzz.bin" "$work/ok.in" > /dev/null 2>"$work/err"
+grep -q "^fuzz: 1 inputs, 3 edges covered" "$work/err" || fail "--fuzz replay of the loop: $(cat "$work/err")"
+
+[ $failed = 0 ] && echo "All tests passed"
+exit $failed
@@ -23,311 +23,5487 @@
  *
  * Supported ecall services:
  * - ecall 1: Print an integer (value in register a0).
+ * - ecall 2: Read one byte of input into register a0 (0xFFFF at end of input).
  * - ecall 5: Print a NULL-terminated string (address in register a0).
  * - ecall 3: Terminate the simulation.
  *
+ * Build:
+ * g++ -std=c++17 -O2 -pthread -o z16sim z16sim.cpp
+ *
  * Usage:
- * z16sim <machine_code_file_name>
+ * z16sim [options] <machine_code_file_name>
+ * z16sim [options] --batch <manifest>
+ * z16sim [options] --bench
+ * z16sim --decode-trace <binary_trace_file>
+ *
+ * Options:
+ * --engine=reference   Step one instruction at a time (default).
+ * --engine=threaded    Direct-threaded interpreter core; prints only ecall output.
+ * --engine=block       Basic-block translation cache with block chaining; prints only
+ *                      ecall output.
+ * --engine=jit         Block engine that compiles hot blocks to x86-64 code (falls back
+ *                      to the block interpreter on other hosts).
+ * --jit-threshold=N    Block executions before the JIT compiles a block (default 50).
+ * --no-fusion          Do not fuse instruction pairs into superinstructions in hot blocks
+ *                      (block and jit engines).
+ * --fusion-stats       After the run, print how many sites of each fusion pattern were
+ *                      formed and how often they ran (to stderr).
+ * --trace=LEVEL        Per-instruction trace on stdout: none, pc, disasm (address and
+ *                      disassembly) or full (disasm plus the registers after each
+ *                      instruction). Defaults to disasm for the reference engine and none
+ *                      for the others; any other level runs through the stepping loop.
+ * --trace-file=PATH    Also write a binary trace (see "Binary Trace") to PATH; runs
+ *                      through the stepping loop. Convert it to text later with
+ *                      --decode-trace.
+ * --verify             After the run, rerun the program through executeInstruction() and
+ *                      check that registers, PC, memory and the instruction count match
+ *                      (exit status 1 if not).
+ * --inst-limit=N       Stop after N instructions (default: no limit).
+ * --profile[=PATH]     Count executions per operation, per address and per back-edge and
+ *                      write the instruction mix, the hottest addresses (disassembled),
+ *                      basic blocks and loops to PATH (default stderr) at exit. Runs
+ *                      through the stepping loop.
+ * --flamegraph=PATH    Follow guest calls (jal/jalr writing ra, jr ra) and write folded
+ *                      stacks for flamegraph.pl or speedscope to PATH. Runs through the
+ *                      stepping loop.
+ * --flamegraph-period=N  Sample the stack every N instructions (default 1: every one).
+ * --symbols=PATH       Name flame graph frames from "address name" lines in PATH.
+ * --icache=SPEC, --dcache=SPEC, --l2cache=SPEC
+ *                      Model set-associative caches (SPEC is SIZE:LINE:WAYS[:lru|plru|random],
+ *                      e.g. 4k:16:2:plru) on fetches, loads/stores and behind both, and
+ *                      report hits and misses per cache and per address (to stderr) at exit.
+ *                      Runs through the stepping loop.
+ * --bpred=KIND[:N[:H]] Model a static, bimodal or gshare branch predictor (N counters, H
+ *                      history bits) with a return address stack and a branch target buffer
+ *                      for jr/jalr, and report misprediction rates per class and per branch
+ *                      (to stderr) at exit. Runs through the stepping loop.
+ * --btb=N, --ras=N     Branch target buffer entries (default 64) and return address stack
+ *                      depth (default 8) of the --bpred model; 0 disables either.
+ * --timing[=PATH]      Estimate cycles for an in-order pipeline from per-class latencies
+ *                      in PATH (see "Timing Model"), adding penalties from --icache,
+ *                      --dcache, --l2cache and --bpred when given and for load-use
+ *                      hazards; report cycles, CPI and stalls (to stderr) at exit. Runs
+ *                      through the stepping loop.
+ * --save-snapshot=PATH After the run (for instance one stopped by --inst-limit), write the
+ *                      machine state and the memory pages that differ from the image to PATH.
+ * --restore=PATH       Start from a snapshot of the same image instead of from reset. The
+ *                      instruction count, and so --inst-limit, continues from the snapshot.
+ * --page-size=N        Dirty-page tracking granularity, and so snapshot page size: a power
+ *                      of two from 256 (default) to 4096 bytes.
+ * --record=PATH        Log every value the program reads (ecall 2) with its instruction
+ *                      count to PATH (see "Record and Replay").
+ * --replay=PATH        Read input from a --record log instead of stdin, reproducing the
+ *                      recorded run exactly on any engine (with the same --restore, if any;
+ *                      the recorded --inst-limit applies unless another is given). Exit
+ *                      status 1 if the run diverges from the recording.
+ * --debug[=PATH]       Run under a command loop with breakpoints, step-back and
+ *                      reverse-continue (see "Reverse Debugging"), reading commands from PATH
+ *                      (default stdin; the program then reads input only from --replay).
+ * --checkpoint-interval=N  Instructions between the debugger's checkpoints at first (default
+ *                      100000); doubles whenever the checkpoints outgrow their budget.
+ * --checkpoint-memory=SIZE Memory budget of the checkpoints (default 16M).
+ * --coverage=PATH      Record which instructions executed and which way each branch went
+ *                      (see "Coverage") and write the bitmaps to PATH. Runs through the
+ *                      stepping loop.
+ * --coverage-report[=PATH]  Also write the covered address ranges, the unexecuted parts of
+ *                      the image and branches that only went one way to PATH (default stderr).
+ * --line-map=PATH, --lcov=PATH
+ *                      Also write an lcov tracefile (line and branch coverage) to the --lcov
+ *                      PATH, mapping addresses to source lines with the "address file:line"
+ *                      lines of the --line-map PATH.
+ *
+ * Batch mode:
+ * z16sim [--engine=...] [--inst-limit=N] [--jobs=N] [--batch-out=PATH] --batch <manifest>
+ *
+ * Runs every image listed in the manifest (one path per line) on a work-stealing thread
+ * pool, one machine per worker reset before each image. Ecall output is captured rather
+ * than printed. One tab-separated result line per image (path, exit reason, instruction
+ * count, output length, FNV-1a hash of the output) goes to PATH or stdout, in manifest
+ * order. --jobs defaults to the number of hardware threads. The coverage options record the
+ * union of all tasks (runs through the stepping loop; the report has no disassembly).
+ *
+ * Benchmarks:
+ * z16sim [--bench-scale=N] [--bench-json=PATH] --bench
+ *
+ * Runs the built-in synthetic workloads (ALU loop, random branches, load/store streaming,
+ * calls and returns, ecalls) on every engine and reports MIPS, ns per instruction and host
+ * cycles per instruction, optionally also as JSON. --bench-scale multiplies the run length
+ * (up to 511 outer passes per workload).
+ *
+ * Fuzzing:
+ * z16sim [--inst-limit=N] [--fuzz-entry=ADDR] [--fuzz-buffer=ADDR] [--fuzz-max-len=N]
+ *        --fuzz <image> [input...]
+ *
+ * Runs the image to ADDR (default 0) once, then runs each input file from that point with
+ * the input copied to the buffer (default 0x8000, at most 256 bytes; a0 = length, a1 =
+ * buffer) and prints its outcome (ok, crash, hang) and instruction count, then the number of
+ * guest edges covered. --inst-limit is per input (default 1000000). The same harness is the
+ * libFuzzer target when built with -DZ16_LIBFUZZER -fsanitize=fuzzer (clang, configured
+ * through Z16_FUZZ_* environment variables) and runs AFL's persistent mode when built with
+ * afl-clang-fast++ and given no input files (see "Fuzzing Harness").
+ *
+ * Coverage merging:
+ * z16sim [--coverage=PATH] [--coverage-report[=PATH]] [--line-map=PATH --lcov=PATH]
+ *        --coverage-merge <image> <coverage_file...>
+ *
+ * ORs the coverage files written by earlier runs of the image (or batches over it) and
+ * writes the merged bitmaps, report and lcov tracefile.
  */
 
 #include <stdio.h>
+#include <stddef.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
 #include <ctype.h>
 
+#if defined(__unix__) || defined(__APPLE__)
+#define Z16_MMAP 1
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#else
+#define Z16_MMAP 0
+#endif
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
 #define MEM_SIZE 65536 // 64KB memory
+#define DIRTY_PAGE_MIN 256  // smallest page tracked by the dirty-page bitmap
+#define DIRTY_PAGE_MAX 4096
 
-// Global simulated memory and register file.
-unsigned char memory[MEM_SIZE];
-uint16_t regs[8]; // 8 registers (16-bit each): x0, x1, x2, x3, x4, x5, x6, x7
-uint16_t pc = 0;  // Program counter (16-bit)
 
 // Register ABI names for display (x0 = t0, x1 = ra, x2 = sp, x3 = s0, x4 = s1, x5 = t1, x6 = a0, x7 = a1)
 const char *regNames[8] = {"t0", "ra", "sp", "s0", "s1", "t1", "a0", "a1"};
 
 // -----------------------
-// Disassembly Function
+// Instruction Decoding
 // -----------------------
 //
-// Decodes a 16-bit instruction 'inst' (fetched at address 'pc') and writes a human-readable
-// string to 'buf' (of size bufSize). This decoder uses the opcode (bits [2:0]) to distinguish
-// among R-, I-, B-, L-, J-, U-, and System instructions.
-void disassemble(uint16_t inst, uint16_t pc, char *buf, size_t bufSize) {
+// Operation ids produced by the decoder. OP_UNDECODED marks an empty predecode cache slot;
+// OP_ILLEGAL covers encodings that no Z16 instruction uses (executed as a no-op).
+enum {
+    OP_UNDECODED = 0, OP_ILLEGAL,
+    OP_ADD, OP_SUB, OP_SLT, OP_SLTU, OP_SLL, OP_SRL, OP_SRA, OP_OR, OP_AND, OP_XOR, OP_MV,
+    OP_JR, OP_JALR,
+    OP_ADDI, OP_SLTI, OP_SLTUI, OP_SLLI, OP_SRLI, OP_SRAI, OP_ORI, OP_ANDI, OP_XORI, OP_LI,
+    OP_BEQ, OP_BNE, OP_BZ, OP_BNZ, OP_BLT, OP_BGE, OP_BLTU, OP_BGEU,
+    OP_SB, OP_SW,
+    OP_LB, OP_LW, OP_LBU,
+    OP_J, OP_JAL,
+    OP_LUI, OP_AUIPC,
+    OP_ECALL,
+    OP_COUNT
+};
+
+// Superinstructions the block engine forms from hot instruction pairs. The decoder never
+// produces them (see "Superinstruction Fusion").
+enum {
+    OP_FUSED_LUI_ADDI = OP_COUNT, // lui rd, hi; addi rd, lo          (imm = hi + lo)
+    OP_FUSED_ADDI_SW,             // addi rd, k; sw rs2, off(rd)      (imm = k | off << 8)
+    OP_FUSED_SLT_BZ,              // slt rd, rs2; bz rd, offset       (imm = offset)
+    OP_FUSED_SLT_BNZ,
+    OP_FUSED_SLTU_BZ,
+    OP_FUSED_SLTU_BNZ,
+};
+
+enum { FUSION_LUI_ADDI, FUSION_ADDI_SW, FUSION_SLT_BRANCH, FUSION_KINDS };
+static const char *fusionNames[FUSION_KINDS] = {"lui+addi", "addi+sw", "slt+bz/bnz"};
+
+// A decoded instruction: operation id, register fields and the immediate already
+// sign-extended (or shifted into place for U-type; the service number for ecall). 'cycles'
+// is the base latency under the timing model, stamped when a timed machine decodes into its
+// cache (0 otherwise); it fills what would be padding.
+typedef struct {
+    uint8_t op;
+    uint8_t rd;  // bits [8:6]: rd/rs1
+    uint8_t rs2; // bits [11:9]
+    uint8_t cycles;
+    int16_t imm;
+} DecodedInst;
+
+// The decoder proper. It is only evaluated at compile time, to fill decodeTable.
+static constexpr uint8_t rTypeOps[13] = {OP_ADD, OP_SUB, OP_SLT, OP_SLTU, OP_SLL, OP_SRL, OP_SRA,
+                                         OP_OR, OP_AND, OP_XOR, OP_MV, OP_JR, OP_JALR};
+static constexpr uint8_t rTypeFunct3[13] = {0, 0, 1, 2, 3, 3, 3, 4, 5, 6, 7, 0, 0};
+
+static constexpr DecodedInst decodeFields(uint16_t inst) {
+    DecodedInst d = {};
     uint8_t opcode = inst & 0x7;
+    uint8_t funct3 = (inst >> 3) & 0x7;
+    d.op = OP_ILLEGAL;
+    d.rd = (inst >> 6) & 0x7;
+    d.rs2 = (inst >> 9) & 0x7;
+    d.imm = 0;
+
     switch (opcode) {
-        case 0x0: { // R-type: [15:12] funct4 | [11:9] rs2 | [8:6] rd/rs1 | [5:3] funct3 | [2:0] opcode
+        case 0x0: { // R-type: [15:12] funct4 | [11:9] rs2 | [8:6] rd/rs1 | [5:3] funct3
             uint8_t funct4 = (inst >> 12) & 0xF;
-            uint8_t rs2 = (inst >> 9) & 0x7;
-            uint8_t rd_rs1 = (inst >> 6) & 0x7;
-            uint8_t funct3 = (inst >> 3) & 0x7;
-
-            if (funct4 == 0x0 && funct3 == 0x0)
-                printf("add %s, %s", regNames[rd_rs1], regNames[rs2]);
-            else if (funct4 == 0x1 && funct3 == 0x0)
-                printf("sub %s, %s", regNames[rd_rs1], regNames[rs2]);
-            else if (funct4 == 0x2 && funct3 == 0x1)
-                printf("slt %s, %s", regNames[rd_rs1], regNames[rs2]);
-            else if (funct4 == 0x3 && funct3 == 0x2)
-                printf("sltu %s, %s", regNames[rd_rs1], regNames[rs2]);
-            else if (funct4 == 0x4 && funct3 == 0x3)
-                printf("sll %s, %s", regNames[rd_rs1], regNames[rs2]);
-            else if (funct4 == 0x5 && funct3 == 0x3)
-                printf("srl %s, %s", regNames[rd_rs1], regNames[rs2]);
-            else if (funct4 == 0x6 && funct3 == 0x3)
-                printf("sra %s, %s", regNames[rd_rs1], regNames[rs2]);
-            else if (funct4 == 0x7 && funct3 == 0x4)
-                printf("or %s, %s", regNames[rd_rs1], regNames[rs2]);
-            else if (funct4 == 0x8 && funct3 == 0x5)
-                printf("and %s, %s", regNames[rd_rs1], regNames[rs2]);
-            else if (funct4 == 0x9 && funct3 == 0x6)
-                printf("xor %s, %s", regNames[rd_rs1], regNames[rs2]);
-            else if (funct4 == 0xA && funct3 == 0x7)
-                printf("mv %s, %s", regNames[rd_rs1], regNames[rs2]);
-            else if (funct4 == 0xB && funct3 == 0x0)
-                printf("jr %s", regNames[rd_rs1]);
-            else if (funct4 == 0xC && funct3 == 0x0)
-                printf("jalr %s, %s", regNames[rd_rs1], regNames[rs2]);
-            break;
-        }
-        case 0x1: { // I-type: [15:9] imm[6:0] | [8:6] rd/rs1 | [5:3] funct3 | [2:0] opcode
-            uint8_t imm7 = (inst >> 9) & 0xF;
-            uint8_t rd_rs1 = (inst >> 6) & 0x7;
-            uint8_t funct3 = (inst >> 3) & 0x7;
-
-            if (funct3 == 0x0)
-                printf("addi %s, %i", regNames[rd_rs1], imm7);
-            else if (funct3 == 0x1)
-                printf("slti %s, %i", regNames[rd_rs1], imm7);
-            else if (funct3 == 0x2)
-                printf("sltui %s, %i", regNames[rd_rs1], imm7);
-            else if (funct3 == 0x3){
-                uint8_t shamt_mode = (imm7 >> 4) & 0x7;  
-                uint8_t shamt = imm7 & 0xF;            
-
-                if (shamt_mode == 0x1)
-                    printf("slli %s, %u", regNames[rd_rs1], shamt);
-                else if (shamt_mode == 0x2)
-                    printf("srli %s, %u", regNames[rd_rs1], shamt);
-                else if (shamt_mode == 0x4)
-                    printf("srai %s, %u", regNames[rd_rs1], shamt);
-                else
-                    printf("unknown shift %s, imm=0x%02X", regNames[rd_rs1], imm7);
-
-            }else if (funct3 == 0x4)
-                printf("ori %s, %i", regNames[rd_rs1], imm7);
-            else if (funct3 == 0x5)
-                printf("andi %s, %i", regNames[rd_rs1], imm7);
-            else if (funct3 == 0x6)
-                printf("xori %s, %i", regNames[rd_rs1], imm7);
-            else if (funct3 == 0x7)
-                printf("li %s, %i", regNames[rd_rs1], imm7);
-
-            break;
-        }
-        case 0x2: { // B-type (branch): [15:12] offset[4:1] | [11:9] rs2 | [8:6] rs1 | [5:3] funct3 | [2:0] opcode
-            uint8_t offset = (inst >> 12) & 0xF;
-            uint8_t rs2 = (inst >> 9) & 0x7;
-            uint8_t rd_rs1 = (inst >> 6) & 0x7;
-            uint8_t funct3 = (inst >> 3) & 0x7;
-
-            if (funct3 == 0x0)
-                printf("beq %s, %s, %i", regNames[rd_rs1], regNames[rs2],offset);
-            else if (funct3 == 0x1)
-                printf("bne %s, %s, %i", regNames[rd_rs1], regNames[rs2], offset);
-            else if (funct3 == 0x2)
-                printf("bz %s, %i", regNames[rd_rs1], offset); // rs2 ignored
-            else if (funct3 == 0x3)
-                printf("bnz %s, %i", regNames[rd_rs1], offset); // rs2 ignored
-            else if (funct3 == 0x4)
-                printf("blt %s, %s, %i", regNames[rd_rs1], regNames[rs2], offset);
-            else if (funct3 == 0x5)
-                printf("bge %s, %s, %i", regNames[rd_rs1], regNames[rs2], offset);
-            else if (funct3 == 0x6)
-                printf("bltu %s, %s, %i", regNames[rd_rs1], regNames[rs2], offset);
-            else if (funct3 == 0x7)
-                printf("bgeu %s, %s, %i", regNames[rd_rs1], regNames[rs2], offset);
-
-            break;
-        }
-        case 0x3: { // S-type: [15:12] imm[3:0] | [11:9] rs2 | [8:6] rs1 | [5:3] func3 | [2:0] opcode
-            uint8_t offset = (inst >> 12) & 0xF;
-            uint8_t rs2 = (inst >> 9) & 0x7;
-            uint8_t rd_rs1 = (inst >> 6) & 0x7;
-            uint8_t funct3 = (inst >> 3) & 0x7;
-
-            if (funct3 == 0x0)
-                printf("sb %s, %i(%s)", regNames[rd_rs1], offset, regNames[rs2]);
-            else if (funct3 == 0x1)
-                printf("sw %s, %i(%s)", regNames[rd_rs1], offset, regNames[rs2]);
-          
-            break;
-        }
-        case 0x4: { // L-type: [15:12] imm[3:0] | [11:9] rs2 | [8:6] rd | [5:3] func3 | [2:0] opcode
-            uint8_t offset = (inst >> 12) & 0xF;
-            uint8_t rs2 = (inst >> 9) & 0x7;
-            uint8_t rd = (inst >> 6) & 0x7;
-            uint8_t funct3 = (inst >> 3) & 0x7;
-
-            if (funct3 == 0x0)
-                printf("lb %s, %i(%s)", regNames[rd], offset, regNames[rs2]);
-            else if (funct3 == 0x1)
-                printf("lw %s, %i(%s)", regNames[rd], offset, regNames[rs2]);
-            else if (funct3 == 0x4)
-                printf("lbu %s, %i(%s)", regNames[rd], offset, regNames[rs2]);
-          
-            break;
-        }
-        case 0x5: { // J-type: [15] link flag | [14:9] imm2[9:4] | [8:6] rd | [5:3] imm1[3:1] | [2:0] opcode
-            uint8_t flag = (inst >> 15) & 0x1;
-            uint8_t rd = (inst >> 6) & 0x7;
-            uint8_t imm_high = (inst >> 9) & 0x3F;   // imm[9:4]
-            uint8_t imm_low  = (inst >> 3) & 0x7;    // imm[3:1]
-            uint16_t imm = (imm_high << 4) | (imm_low << 1);  // add the LSB 0
-
-            if (flag == 0x0)
-                printf("j %i", imm);
-            else if (flag == 0x1)
-                printf("jal %s, %i", regNames[rd], imm);
-          
-            break;
-        }
-        case 0x6: { // U-type: [15] link flag | [14:9] imm2[15:10] | [8:6] rd | [5:3] imm1[9:7] | [2:0] opcode
-            uint8_t flag = (inst >> 15) & 0x1;
-            uint8_t rd = (inst >> 6) & 0x7;
-            uint8_t imm_high = (inst << 9) & 0x3F;   // imm[15:10]
-            uint8_t imm_low  = (inst >> 3) & 0x7;    // imm[3:1]
-            uint16_t imm = (imm_high << 10) | (imm_low << 7);  // add the LSB 0
-
-            if (flag == 0x0)
-                printf("lui %s, %i", regNames[rd], imm);
-            else if (flag == 0x1)
-                printf("auipc %s, %i", regNames[rd], imm);
-          
-            break;
-        }
-        case 0x7: { // SYS-type: [15:6] svc (10-bit system-call number) | [5:3] 000 | [2:0] opcode
-            uint8_t svc = (inst >> 6) & 0x1FF;
-            printf("ecall %i", svc);
+            if (funct4 < 13 && rTypeFunct3[funct4] == funct3)
+                d.op = rTypeOps[funct4];
+            break;
+        }
+        case 0x1: { // I-type: [15:9] imm[6:0] | [8:6] rd/rs1 | [5:3] funct3
+            uint8_t imm7 = (inst >> 9) & 0x7F;
+            d.imm = (imm7 & 0x40) ? (int16_t)(imm7 | 0xFF80) : imm7;
+            switch (funct3) {
+                case 0x0: d.op = OP_ADDI; break;
+                case 0x1: d.op = OP_SLTI; break;
+                case 0x2: d.op = OP_SLTUI; break;
+                case 0x3: { // shifts: imm[6:4] selects the shift, imm[3:0] is the amount
+                    uint8_t shamt_mode = (imm7 >> 4) & 0x7;
+                    d.imm = imm7 & 0xF;
+                    if (shamt_mode == 0x1)
+                        d.op = OP_SLLI;
+                    else if (shamt_mode == 0x2)
+                        d.op = OP_SRLI;
+                    else if (shamt_mode == 0x4)
+                        d.op = OP_SRAI;
+                    break;
+                }
+                case 0x4: d.op = OP_ORI; break;
+                case 0x5: d.op = OP_ANDI; break;
+                case 0x6: d.op = OP_XORI; break;
+                case 0x7: d.op = OP_LI; break;
+            }
+            break;
+        }
+        case 0x2: { // B-type: [15:12] offset[4:1] | [11:9] rs2 | [8:6] rs1, offset[0] = 0
+            uint8_t off = ((inst >> 12) & 0xF) << 1;
+            d.imm = (off & 0x10) ? (int16_t)(off | 0xFFE0) : off;
+            d.op = OP_BEQ + funct3;
+            break;
+        }
+        case 0x3: // S-type: mem[rs1 + imm] <- rs2
+        case 0x4: { // L-type: rd <- mem[rs2 + imm]
+            uint8_t imm4 = (inst >> 12) & 0xF;
+            d.imm = (imm4 & 0x8) ? (int16_t)(imm4 | 0xFFF0) : imm4;
+            if (opcode == 0x3) {
+                if (funct3 == 0x0)
+                    d.op = OP_SB;
+                else if (funct3 == 0x1)
+                    d.op = OP_SW;
+            } else {
+                if (funct3 == 0x0)
+                    d.op = OP_LB;
+                else if (funct3 == 0x1)
+                    d.op = OP_LW;
+                else if (funct3 == 0x4)
+                    d.op = OP_LBU;
+            }
+            break;
+        }
+        case 0x5: { // J-type: [15] link | [14:9] offset[9:4] | [8:6] rd | [5:3] offset[3:1]
+            uint16_t off = (((inst >> 9) & 0x3F) << 4) | (((inst >> 3) & 0x7) << 1);
+            d.imm = (off & 0x200) ? (int16_t)(off | 0xFC00) : off;
+            d.op = ((inst >> 15) & 0x1) ? OP_JAL : OP_J;
+            break;
+        }
+        case 0x6: { // U-type: [15] auipc | [14:9] imm[15:10] | [8:6] rd | [5:3] imm[9:7]
+            d.imm = (int16_t)((((inst >> 9) & 0x3F) << 10) | (((inst >> 3) & 0x7) << 7));
+            d.op = ((inst >> 15) & 0x1) ? OP_AUIPC : OP_LUI;
             break;
         }
+        case 0x7: // SYS-type: [15:6] service number
+            d.imm = (inst >> 6) & 0x3FF;
+            d.op = OP_ECALL;
+            break;
+    }
+    return d;
+}
+
+// Every 16-bit word decoded ahead of time by the compiler. The executor, the predecode
+// cache, the block translator and the disassembler all decode through this table, so
+// they cannot disagree about an encoding.
+struct DecodeTable {
+    DecodedInst entries[65536];
+
+    constexpr DecodeTable() : entries() {
+        for (uint32_t inst = 0; inst < 65536; inst++)
+            entries[inst] = decodeFields((uint16_t)inst);
+    }
+};
+
+static constexpr DecodeTable decodeTable;
+
+// Extracts the operation and operands of 'inst'.
+static inline DecodedInst decodeInstruction(uint16_t inst) {
+    return decodeTable.entries[inst];
+}
 
+// -----------------------
+// Disassembly Function
+// -----------------------
+//
+// Formats the 16-bit instruction 'inst' (fetched at address 'pc') as a human-readable
+// string in 'buf' (of size bufSize), using the operands from the decode table: immediates
+// are shown sign-extended, branch and jump offsets relative to the instruction, stores as
+// "sb rs2, offset(rs1)" and loads as "lb rd, offset(rs2)", so 'pc' is not needed yet.
+// Nothing is printed; returns the length of the string written to 'buf'.
+static const char *const opNames[OP_COUNT] = {
+    "", "",
+    "add", "sub", "slt", "sltu", "sll", "srl", "sra", "or", "and", "xor", "mv",
+    "jr", "jalr",
+    "addi", "slti", "sltui", "slli", "srli", "srai", "ori", "andi", "xori", "li",
+    "beq", "bne", "bz", "bnz", "blt", "bge", "bltu", "bgeu",
+    "sb", "sw",
+    "lb", "lw", "lbu",
+    "j", "jal",
+    "lui", "auipc",
+    "ecall",
+};
+
+int disassemble(uint16_t inst, [[maybe_unused]] uint16_t pc, char *buf, size_t bufSize) {
+    DecodedInst d = decodeInstruction(inst);
+    const char *name = opNames[d.op];
+    const char *rd = regNames[d.rd];
+    const char *rs2 = regNames[d.rs2];
+    int n;
+
+    switch (d.op) {
+        case OP_ADD: case OP_SUB: case OP_SLT: case OP_SLTU: case OP_SLL: case OP_SRL:
+        case OP_SRA: case OP_OR: case OP_AND: case OP_XOR: case OP_MV: case OP_JALR:
+            n = snprintf(buf, bufSize, "%s %s, %s", name, rd, rs2);
+            break;
+        case OP_JR:
+            n = snprintf(buf, bufSize, "jr %s", rd);
+            break;
+        case OP_ADDI: case OP_SLTI: case OP_SLTUI: case OP_SLLI: case OP_SRLI: case OP_SRAI:
+        case OP_ORI: case OP_ANDI: case OP_XORI: case OP_LI:
+        case OP_BZ: case OP_BNZ: // rs2 ignored
+        case OP_JAL:
+            n = snprintf(buf, bufSize, "%s %s, %d", name, rd, d.imm);
+            break;
+        case OP_BEQ: case OP_BNE: case OP_BLT: case OP_BGE: case OP_BLTU: case OP_BGEU:
+            n = snprintf(buf, bufSize, "%s %s, %s, %d", name, rd, rs2, d.imm);
+            break;
+        case OP_SB: case OP_SW:
+            n = snprintf(buf, bufSize, "%s %s, %d(%s)", name, rs2, d.imm, rd);
+            break;
+        case OP_LB: case OP_LW: case OP_LBU:
+            n = snprintf(buf, bufSize, "%s %s, %d(%s)", name, rd, d.imm, rs2);
+            break;
+        case OP_J:
+        case OP_ECALL:
+            n = snprintf(buf, bufSize, "%s %d", name, d.imm);
+            break;
+        case OP_LUI: case OP_AUIPC:
+            n = snprintf(buf, bufSize, "%s %s, 0x%04X", name, rd, (uint16_t)d.imm);
+            break;
         default:
-            snprintf(buf, bufSize, "Unknown opcode");
+            n = snprintf(buf, bufSize, "unknown 0x%04X", inst);
             break;
     }
+    return n < (int)bufSize ? n : (int)bufSize - 1;
+}
+
+// -----------------------
+// Machine State
+// -----------------------
+//
+// Everything one simulation owns: memory, register file, PC, the sink for its ecall output
+// and the engines' caches. Machines share no mutable state, so a process can host any
+// number of them (each driven by one thread at a time).
+struct Block;
+struct TraceWriter;
+struct Profile;
+struct CallStacks;
+struct Coverage;
+struct Observer;
+typedef struct Z16Machine Z16Machine;
+
+// Receives the bytes a program prints through ecall.
+typedef void (*OutputFn)(Z16Machine *m, const char *data, size_t len);
+
+// Supplies a value the program reads from outside the machine. Every such read goes through
+// this one function, so a run can be recorded and replayed (see "Record and Replay"); timers
+// and devices would be further sources.
+enum { INPUT_BYTE, INPUT_SOURCES };
+typedef uint16_t (*InputFn)(Z16Machine *m, int source);
+
+// Why a run stopped.
+enum { EXIT_NONE, EXIT_HALT, EXIT_END_OF_MEMORY, EXIT_INST_LIMIT };
+static const char *exitNames[] = {"running", "halt", "end-of-memory", "inst-limit"};
+
+struct Z16Machine {
+    unsigned char *memory; // MEM_SIZE bytes; a private copy-on-write mapping of the image
+    uint16_t regs[8]; // 8 registers (16-bit each): x0, x1, x2, x3, x4, x5, x6, x7
+    uint16_t pc;      // Program counter (16-bit)
+
+    OutputFn output;  // NULL discards ecall output
+    void *outputCtx;
+    InputFn input;    // NULL: every read sees the end of input
+    void *inputCtx;
+
+    uint64_t instret;   // instructions executed, including a terminating ecall
+    uint64_t instLimit; // stop once instret reaches this (0 = no limit)
+    int exitReason;
+
+    // Pages written since the image was loaded, one bit per page of 1 << dirtyShift bytes.
+    uint64_t dirtyPages[MEM_SIZE / DIRTY_PAGE_MIN / 64];
+    int dirtyShift;
+
+    // Predecode cache: one entry per 16-bit word of memory, filled on first execution of that
+    // word and reset to OP_UNDECODED whenever a store writes to it.
+    DecodedInst decodeCache[MEM_SIZE / 2];
+
+    // Block engine state, allocated on first use. blockCodeWords marks words covered by a
+    // translated block; a store that hits one sets codeModified so the block engine can
+    // discard its stale translations.
+    struct Block **blockMap;
+    struct Block *blockList;
+    uint8_t *blockCodeWords;
+    int codeModified;
+
+    // Superinstruction fusion in hot blocks, and its counts for blocks already discarded.
+    int fuse;
+    uint64_t fusedSites[FUSION_KINDS];
+    uint64_t fusedRuns[FUSION_KINDS];
+
+    // JIT code buffer, allocated on first use.
+    int jitThreshold;
+    uint8_t *jitBuffer;
+    uint8_t *jitPtr;
+
+    struct TraceWriter *trace; // binary trace being recorded, if any
+    struct Profile *profile;   // execution counts being collected, if any
+    struct CallStacks *calls;  // guest call stacks being sampled, if any
+    struct Coverage *coverage; // executed addresses and branch directions being recorded, if any
+    struct Observer *observers; // architectural models fed by the stepping loop, if any
+    const uint8_t *latencies;  // per-operation cycles of the timing model, if any
+};
+
+// Stands in for blockCodeWords until a machine runs the block engine (never written).
+static uint8_t noBlockCodeWords[MEM_SIZE / 2];
+
+static void writeToStdout(Z16Machine *m, const char *data, size_t len) {
+    (void)m;
+    fwrite(data, 1, len, stdout);
+}
+
+// Memory is a mapping of its own so that loading an image can replace it with a private
+// view of the image file (see "Memory Loading").
+static unsigned char *allocateMemory(void) {
+#if Z16_MMAP
+    void *p = mmap(NULL, MEM_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    return p == MAP_FAILED ? NULL : (unsigned char *)p;
+#else
+    return (unsigned char *)calloc(1, MEM_SIZE);
+#endif
+}
+
+static void releaseMemory(unsigned char *memory) {
+#if Z16_MMAP
+    munmap(memory, MEM_SIZE);
+#else
+    free(memory);
+#endif
+}
+
+// Allocates a machine with zeroed memory and registers, printing ecall output to stdout.
+Z16Machine *createMachine(void) {
+    Z16Machine *m = (Z16Machine *)calloc(1, sizeof(Z16Machine));
+    if (!m)
+        return NULL;
+    if (!(m->memory = allocateMemory())) {
+        free(m);
+        return NULL;
+    }
+    m->output = writeToStdout;
+    m->dirtyShift = 8; // DIRTY_PAGE_MIN
+    m->blockCodeWords = noBlockCodeWords;
+    m->fuse = 1;
+    m->jitThreshold = 50;
+    return m;
 }
 
 // -----------------------
 // Instruction Execution
 // -----------------------
 //
-// Executes the instruction 'inst' (a 16-bit word) by updating registers, memory, and PC.
-// Returns 1 to continue simulation or 0 to terminate (if ecall 3 is executed).
-int executeInstruction(uint16_t inst) {
-    uint8_t opcode = inst & 0x7;
-    int pcUpdated = 0; // flag: if instruction updated PC directly
+// Stores go through these helpers so that any predecoded copy of the written word is dropped
+// and the page is marked dirty.
+static inline void storeByte(Z16Machine *m, uint16_t addr, uint8_t value) {
+    m->memory[addr] = value;
+    uint32_t page = addr >> m->dirtyShift;
+    m->dirtyPages[page >> 6] |= 1ull << (page & 63);
+    m->decodeCache[addr >> 1].op = OP_UNDECODED;
+    if (m->blockCodeWords[addr >> 1])
+        m->codeModified = 1;
+}
 
-    switch (opcode) {
-        case 0x0: { // R-type
-            uint8_t funct4 = (inst >> 12) & 0xF;
-            uint8_t rs2 = (inst >> 9) & 0x7;
-            uint8_t rd_rs1 = (inst >> 6) & 0x7;
-            uint8_t funct3 = (inst >> 3) & 0x7;
+static inline void storeWord(Z16Machine *m, uint16_t addr, uint16_t value) {
+    storeByte(m, addr, value & 0xFF);
+    storeByte(m, (uint16_t)(addr + 1), value >> 8);
+}
 
-            if (funct4 == 0x0 && funct3 == 0x0) // add
-                regs[rd_rs1] = regs[rd_rs1] + regs[rs2];
-            else if (funct4 == 0x1 && funct3 == 0x0) // sub
-                regs[rd_rs1] = regs[rd_rs1] - regs[rs2];
-            // complete the rest
-            break;
-        }
-        case 0x1: { // I-type
-            uint8_t imm7 = (inst >> 9) & 0x7F;
-            uint8_t rd_rs1 = (inst >> 6) & 0x7;
-            uint8_t funct3 = (inst >> 3) & 0x7;
-            int16_t simm = (imm7 & 0x40) ? (imm7 | 0xFF80) : imm7;
-            // your code goes here
-            break;
-        }
-        case 0x2: { // B-type (branch)
-            // your code goes here
+static inline uint16_t loadWord(const Z16Machine *m, uint16_t addr) {
+    return m->memory[addr] | (m->memory[(uint16_t)(addr + 1)] << 8);
+}
+
+// Executes a system call. Returns 0 when the program asks to terminate.
+int executeEcall(Z16Machine *m, uint16_t svc) {
+    switch (svc) {
+        case 1: { // print the integer in a0
+            char text[8];
+            int len = snprintf(text, sizeof(text), "%d", (int16_t)m->regs[6]);
+            if (m->output)
+                m->output(m, text, len);
             break;
         }
-        case 0x3: { // L-type (load/store)
-            // your code goes here
+        case 5: { // print the NULL-terminated string at a0
+            char text[256];
+            size_t len = 0;
+            uint16_t addr = m->regs[6];
+            while (m->output && m->memory[addr] != 0) {
+                text[len++] = m->memory[addr];
+                if (len == sizeof(text)) {
+                    m->output(m, text, len);
+                    len = 0;
+                }
+                if (++addr == 0)
+                    break;
+            }
+            if (len)
+                m->output(m, text, len);
             break;
         }
-        case 0x5: { // J-type (jump)
-            // your code goes here
+        case 2: // read one byte of input into a0
+            m->regs[6] = m->input ? m->input(m, INPUT_BYTE) : 0xFFFF;
             break;
-        }
-        case 0x6: { // U-type
-            // your code goes here
+        case 3: // terminate
+            m->exitReason = EXIT_HALT;
+            return 0;
+        default:
             break;
-        }
-        case 0x7: { // System instruction (ecall)
-            uint8_t svc = (inst >> 6) & 0x1FF;
+    }
+    return 1;
+}
+
+// Every operation has its own handler, instantiated from the templates below with the
+// operation id as a compile-time constant. Each instance reads only the operands its
+// operation uses and contains no checks of the operation id at run time.
+
+// Semantics of one operation that does not transfer control (ALU, immediate, load, store,
+// lui/auipc; OP_ILLEGAL is ignored). 'instPc' is the address of the instruction (only
+// auipc reads it).
+template <int OP>
+static inline void dataOp(Z16Machine *m, const DecodedInst *d, [[maybe_unused]] uint16_t instPc) {
+    uint16_t *rd = &m->regs[d->rd];
+    const uint16_t rs2 = m->regs[d->rs2];
+    const uint16_t imm = (uint16_t)d->imm;
+
+    if constexpr (OP == OP_ADD)        *rd = *rd + rs2;
+    else if constexpr (OP == OP_SUB)   *rd = *rd - rs2;
+    else if constexpr (OP == OP_SLT)   *rd = (int16_t)*rd < (int16_t)rs2;
+    else if constexpr (OP == OP_SLTU)  *rd = *rd < rs2;
+    else if constexpr (OP == OP_SLL)   *rd = *rd << (rs2 & 0xF);
+    else if constexpr (OP == OP_SRL)   *rd = *rd >> (rs2 & 0xF);
+    else if constexpr (OP == OP_SRA)   *rd = (uint16_t)((int16_t)*rd >> (rs2 & 0xF));
+    else if constexpr (OP == OP_OR)    *rd = *rd | rs2;
+    else if constexpr (OP == OP_AND)   *rd = *rd & rs2;
+    else if constexpr (OP == OP_XOR)   *rd = *rd ^ rs2;
+    else if constexpr (OP == OP_MV)    *rd = rs2;
+
+    else if constexpr (OP == OP_ADDI)  *rd = *rd + imm;
+    else if constexpr (OP == OP_SLTI)  *rd = (int16_t)*rd < d->imm;
+    else if constexpr (OP == OP_SLTUI) *rd = *rd < imm;
+    else if constexpr (OP == OP_SLLI)  *rd = *rd << imm;
+    else if constexpr (OP == OP_SRLI)  *rd = *rd >> imm;
+    else if constexpr (OP == OP_SRAI)  *rd = (uint16_t)((int16_t)*rd >> imm);
+    else if constexpr (OP == OP_ORI)   *rd = *rd | imm;
+    else if constexpr (OP == OP_ANDI)  *rd = *rd & imm;
+    else if constexpr (OP == OP_XORI)  *rd = *rd ^ imm;
+    else if constexpr (OP == OP_LI)    *rd = imm;
+
+    else if constexpr (OP == OP_SB)    storeByte(m, *rd + imm, rs2 & 0xFF);
+    else if constexpr (OP == OP_SW)    storeWord(m, *rd + imm, rs2);
+    else if constexpr (OP == OP_LB)    *rd = (uint16_t)(int8_t)m->memory[(uint16_t)(rs2 + imm)];
+    else if constexpr (OP == OP_LW)    *rd = loadWord(m, rs2 + imm);
+    else if constexpr (OP == OP_LBU)   *rd = m->memory[(uint16_t)(rs2 + imm)];
+
+    else if constexpr (OP == OP_LUI)   *rd = imm;
+    else if constexpr (OP == OP_AUIPC) *rd = instPc + imm;
+}
+
+// Condition of a B-type instruction.
+template <int OP>
+static inline int branchCondition(const Z16Machine *m, const DecodedInst *d) {
+    const uint16_t rs1 = m->regs[d->rd];
+    const uint16_t rs2 = m->regs[d->rs2];
+
+    if constexpr (OP == OP_BEQ)       return rs1 == rs2;
+    else if constexpr (OP == OP_BNE)  return rs1 != rs2;
+    else if constexpr (OP == OP_BZ)   return rs1 == 0;
+    else if constexpr (OP == OP_BNZ)  return rs1 != 0;
+    else if constexpr (OP == OP_BLT)  return (int16_t)rs1 < (int16_t)rs2;
+    else if constexpr (OP == OP_BGE)  return (int16_t)rs1 >= (int16_t)rs2;
+    else if constexpr (OP == OP_BLTU) return rs1 < rs2;
+    else                              return rs1 >= rs2; // OP_BGEU
+}
 
-            
-            if (svc == 0x3FF)  return 0; 
+#define DATA_OP_CASES(X)                                                                   \
+    X(OP_ADD) X(OP_SUB) X(OP_SLT) X(OP_SLTU) X(OP_SLL) X(OP_SRL) X(OP_SRA) X(OP_OR)         \
+    X(OP_AND) X(OP_XOR) X(OP_MV) X(OP_ADDI) X(OP_SLTI) X(OP_SLTUI) X(OP_SLLI) X(OP_SRLI)   \
+    X(OP_SRAI) X(OP_ORI) X(OP_ANDI) X(OP_XORI) X(OP_LI) X(OP_SB) X(OP_SW) X(OP_LB)         \
+    X(OP_LW) X(OP_LBU) X(OP_LUI) X(OP_AUIPC)
+#define BRANCH_OP_CASES(X) \
+    X(OP_BEQ) X(OP_BNE) X(OP_BZ) X(OP_BNZ) X(OP_BLT) X(OP_BGE) X(OP_BLTU) X(OP_BGEU)
+
+// Executes a decoded instruction that does not transfer control, for callers that
+// dispatch on the operation themselves (the block engine).
+static inline void executeDataOp(Z16Machine *m, const DecodedInst *d, uint16_t instPc) {
+    switch (d->op) {
+#define DATA_OP_CASE(op) case op: dataOp<op>(m, d, instPc); break;
+        DATA_OP_CASES(DATA_OP_CASE)
+#undef DATA_OP_CASE
+        default: // OP_ILLEGAL: ignored
             break;
-        }
+    }
+}
+
+// Evaluates the condition of a B-type instruction.
+static inline int branchTaken(const Z16Machine *m, const DecodedInst *d) {
+    switch (d->op) {
+#define BRANCH_OP_CASE(op) case op: return branchCondition<op>(m, d);
+        BRANCH_OP_CASES(BRANCH_OP_CASE)
+#undef BRANCH_OP_CASE
         default:
-            printf("Unknown instruction opcode 0x%X\n", opcode);
-            break;
+            return 0;
+    }
+}
+
+int executeDecoded(Z16Machine *m, const DecodedInst *d);
+
+// Executes one instruction of operation OP at the current PC, including the PC update.
+// Returns 1 to continue simulation or 0 to terminate (ecall 3, or running past the end of
+// memory).
+template <int OP>
+static int execHandler(Z16Machine *m, const DecodedInst *d) {
+    const uint16_t pc = m->pc;
+
+    if constexpr (OP == OP_UNDECODED) { // not decoded yet: decode from memory and redispatch
+        DecodedInst decoded = decodeInstruction(loadWord(m, pc));
+        return executeDecoded(m, &decoded);
+    } else if constexpr (OP == OP_JR) {
+        m->pc = m->regs[d->rd] & 0xFFFE;
+        return 1;
+    } else if constexpr (OP == OP_JALR) {
+        uint16_t target = m->regs[d->rs2];
+        m->regs[d->rd] = pc + 2;
+        m->pc = target & 0xFFFE;
+        return 1;
+    } else if constexpr (OP >= OP_BEQ && OP <= OP_BGEU) {
+        if (branchCondition<OP>(m, d)) {
+            m->pc = (pc + d->imm) & 0xFFFE;
+            return 1;
+        }
+    } else if constexpr (OP == OP_J) {
+        m->pc = (pc + d->imm) & 0xFFFE;
+        return 1;
+    } else if constexpr (OP == OP_JAL) {
+        m->regs[d->rd] = pc + 2;
+        m->pc = (pc + d->imm) & 0xFFFE;
+        return 1;
+    } else if constexpr (OP == OP_ECALL) {
+        if (!executeEcall(m, (uint16_t)d->imm))
+            return 0;
+    } else {
+        dataOp<OP>(m, d, pc);
     }
 
-    if (!pcUpdated)
-        pc += 2; // default: move to next instruction
+    if (pc == MEM_SIZE - 2) { // ran past the end of memory
+        m->exitReason = EXIT_END_OF_MEMORY;
+        return 0;
+    }
+    m->pc = pc + 2; // move to next instruction
     return 1;
 }
 
+typedef int (*ExecHandler)(Z16Machine *m, const DecodedInst *d);
+
+typedef struct {
+    ExecHandler entries[OP_COUNT];
+} ExecHandlerTable;
+
+template <int... OPS>
+static constexpr ExecHandlerTable makeExecHandlers(std::integer_sequence<int, OPS...>) {
+    return ExecHandlerTable{{execHandler<OPS>...}};
+}
+
+// One specialized handler per operation id, indexed by DecodedInst::op.
+static constexpr ExecHandlerTable execHandlers = makeExecHandlers(std::make_integer_sequence<int, OP_COUNT>());
+
+// Executes the decoded instruction 'd' located at the current PC of 'm' by updating
+// registers, memory, and PC. Returns 1 to continue simulation or 0 to terminate (ecall 3,
+// or running past the end of memory).
+int executeDecoded(Z16Machine *m, const DecodedInst *d) {
+    return execHandlers.entries[d->op](m, d);
+}
+
+// Executes the instruction 'inst' (a 16-bit word) on 'm' by updating registers, memory, and
+// PC. Returns 1 to continue simulation or 0 to terminate (if ecall 3 is executed).
+int executeInstruction(Z16Machine *m, uint16_t inst) {
+    return executeDecoded(m, &decodeTable.entries[inst]);
+}
+
 // -----------------------
-// Memory Loading
+// Threaded-Code Engine
 // -----------------------
 //
-// Loads the binary machine code image from the specified file into simulated memory.
-void loadMemoryFromFile(const char *filename) {
-    FILE *fp = fopen(filename, "rb");
-    if (!fp) {
-        perror("Error opening binary file");
-        exit(1);
+// Alternative interpreter core over the predecode cache. Every handler ends in its own
+// dispatch jump (GCC/Clang labels-as-values), so the host branch predictor sees one indirect
+// branch per guest operation instead of a shared switch plus funct compare chains. Other
+// compilers fall back to a switch over the same handlers. Runs until ecall 3 or until
+// execution runs past the end of memory or reaches the instruction limit; prints no
+// instruction listing. The PC, the instruction count and the register file pointer live in
+// locals so stores through memory[] cannot force reloads.
+#if defined(__GNUC__)
+#define Z16_COMPUTED_GOTO 1
+#else
+#define Z16_COMPUTED_GOTO 0
+#endif
+
+void runThreaded(Z16Machine *m) {
+    uint16_t pc = m->pc;
+    uint64_t instret = m->instret;
+    const uint64_t limit = m->instLimit ? m->instLimit : UINT64_MAX;
+    uint16_t *regs = m->regs;
+    unsigned char *memory = m->memory;
+    DecodedInst *decodeCache = m->decodeCache;
+    DecodedInst *d;
+
+#if Z16_COMPUTED_GOTO
+    static void *const labels[OP_COUNT] = {
+        &&L_OP_UNDECODED, &&L_OP_ILLEGAL,
+        &&L_OP_ADD, &&L_OP_SUB, &&L_OP_SLT, &&L_OP_SLTU, &&L_OP_SLL, &&L_OP_SRL, &&L_OP_SRA,
+        &&L_OP_OR, &&L_OP_AND, &&L_OP_XOR, &&L_OP_MV,
+        &&L_OP_JR, &&L_OP_JALR,
+        &&L_OP_ADDI, &&L_OP_SLTI, &&L_OP_SLTUI, &&L_OP_SLLI, &&L_OP_SRLI, &&L_OP_SRAI,
+        &&L_OP_ORI, &&L_OP_ANDI, &&L_OP_XORI, &&L_OP_LI,
+        &&L_OP_BEQ, &&L_OP_BNE, &&L_OP_BZ, &&L_OP_BNZ, &&L_OP_BLT, &&L_OP_BGE, &&L_OP_BLTU, &&L_OP_BGEU,
+        &&L_OP_SB, &&L_OP_SW,
+        &&L_OP_LB, &&L_OP_LW, &&L_OP_LBU,
+        &&L_OP_J, &&L_OP_JAL,
+        &&L_OP_LUI, &&L_OP_AUIPC,
+        &&L_OP_ECALL,
+    };
+#define REDISPATCH() goto *labels[d->op]
+#define TARGET(op) case op: L_##op
+#else
+#define REDISPATCH() goto dispatch_op
+#define TARGET(op) case op
+#endif
+#define STOP(reason) do { m->pc = pc; m->instret = instret; m->exitReason = reason; return; } while (0)
+#define DISPATCH() do {                                   \
+        if (instret == limit)                             \
+            STOP(EXIT_INST_LIMIT);                        \
+        instret++;                                        \
+        d = &decodeCache[pc >> 1];                        \
+        REDISPATCH();                                     \
+    } while (0)
+#define RD regs[d->rd]
+#define RS2 regs[d->rs2]
+#define IMM ((uint16_t)d->imm)
+// Sequential successor; wrapping to address 0 means execution ran past the end of memory.
+#define NEXT() do { pc += 2; if (pc == 0) { pc = MEM_SIZE - 2; STOP(EXIT_END_OF_MEMORY); } DISPATCH(); } while (0)
+#define JUMP_TO(target) do { pc = (target) & 0xFFFE; DISPATCH(); } while (0)
+#define BRANCH(cond) do { if (cond) JUMP_TO(pc + IMM); NEXT(); } while (0)
+
+    DISPATCH();
+#if !Z16_COMPUTED_GOTO
+dispatch_op:
+#endif
+    switch (d->op) {
+        TARGET(OP_UNDECODED):
+            *d = decodeInstruction(loadWord(m, pc));
+            REDISPATCH();
+        TARGET(OP_ILLEGAL):
+            NEXT();
+
+        TARGET(OP_ADD):   RD = RD + RS2; NEXT();
+        TARGET(OP_SUB):   RD = RD - RS2; NEXT();
+        TARGET(OP_SLT):   RD = (int16_t)RD < (int16_t)RS2; NEXT();
+        TARGET(OP_SLTU):  RD = RD < RS2; NEXT();
+        TARGET(OP_SLL):   RD = RD << (RS2 & 0xF); NEXT();
+        TARGET(OP_SRL):   RD = RD >> (RS2 & 0xF); NEXT();
+        TARGET(OP_SRA):   RD = (uint16_t)((int16_t)RD >> (RS2 & 0xF)); NEXT();
+        TARGET(OP_OR):    RD = RD | RS2; NEXT();
+        TARGET(OP_AND):   RD = RD & RS2; NEXT();
+        TARGET(OP_XOR):   RD = RD ^ RS2; NEXT();
+        TARGET(OP_MV):    RD = RS2; NEXT();
+        TARGET(OP_JR):    JUMP_TO(RD);
+        TARGET(OP_JALR): {
+            uint16_t target = RS2;
+            RD = pc + 2;
+            JUMP_TO(target);
+        }
+
+        TARGET(OP_ADDI):  RD = RD + IMM; NEXT();
+        TARGET(OP_SLTI):  RD = (int16_t)RD < d->imm; NEXT();
+        TARGET(OP_SLTUI): RD = RD < IMM; NEXT();
+        TARGET(OP_SLLI):  RD = RD << IMM; NEXT();
+        TARGET(OP_SRLI):  RD = RD >> IMM; NEXT();
+        TARGET(OP_SRAI):  RD = (uint16_t)((int16_t)RD >> IMM); NEXT();
+        TARGET(OP_ORI):   RD = RD | IMM; NEXT();
+        TARGET(OP_ANDI):  RD = RD & IMM; NEXT();
+        TARGET(OP_XORI):  RD = RD ^ IMM; NEXT();
+        TARGET(OP_LI):    RD = IMM; NEXT();
+
+        TARGET(OP_BEQ):   BRANCH(RD == RS2);
+        TARGET(OP_BNE):   BRANCH(RD != RS2);
+        TARGET(OP_BZ):    BRANCH(RD == 0);
+        TARGET(OP_BNZ):   BRANCH(RD != 0);
+        TARGET(OP_BLT):   BRANCH((int16_t)RD < (int16_t)RS2);
+        TARGET(OP_BGE):   BRANCH((int16_t)RD >= (int16_t)RS2);
+        TARGET(OP_BLTU):  BRANCH(RD < RS2);
+        TARGET(OP_BGEU):  BRANCH(RD >= RS2);
+
+        TARGET(OP_SB):    storeByte(m, RD + IMM, RS2 & 0xFF); NEXT();
+        TARGET(OP_SW):    storeWord(m, RD + IMM, RS2); NEXT();
+        TARGET(OP_LB):    RD = (uint16_t)(int8_t)memory[(uint16_t)(RS2 + IMM)]; NEXT();
+        TARGET(OP_LW):    RD = loadWord(m, RS2 + IMM); NEXT();
+        TARGET(OP_LBU):   RD = memory[(uint16_t)(RS2 + IMM)]; NEXT();
+
+        TARGET(OP_J):     JUMP_TO(pc + IMM);
+        TARGET(OP_JAL):   RD = pc + 2; JUMP_TO(pc + IMM);
+
+        TARGET(OP_LUI):   RD = IMM; NEXT();
+        TARGET(OP_AUIPC): RD = pc + IMM; NEXT();
+
+        TARGET(OP_ECALL):
+            m->pc = pc;
+            m->instret = instret; // input reads are logged by instruction count
+            if (!executeEcall(m, IMM)) {
+                m->instret = instret;
+                return;
+            }
+            NEXT();
     }
-    size_t n = fread(memory, 1, MEM_SIZE, fp);
-    fclose(fp);
-    printf("Loaded %zu bytes into memory\n", n);
+
+#undef STOP
+#undef REDISPATCH
+#undef DISPATCH
+#undef TARGET
+#undef RD
+#undef RS2
+#undef IMM
+#undef NEXT
+#undef JUMP_TO
+#undef BRANCH
 }
 
 // -----------------------
-// Main Simulation Loop
+// Basic-Block Engine
 // -----------------------
-int main(int argc, char **argv) {
-    if (argc != 2) {
-        fprintf(stderr, "Usage: %s <machine_code_file>\n", argv[0]);
-        exit(1);
+//
+// Translates each guest basic block once into an array of decoded micro-ops and runs it
+// without per-instruction PC bookkeeping: the PC is only materialized, and the end of
+// memory only checked, at block boundaries. A block ends at a B-type, J-type, jr/jalr or
+// ecall instruction (or after MAX_BLOCK_INSTS instructions, or at the end of memory).
+// Blocks remember their successors so hot paths chain from block to block without a
+// lookup. A store into translated code discards every block once the storing instruction
+// has completed.
+#define MAX_BLOCK_INSTS 64
+
+typedef struct Block {
+    uint16_t startPc;
+    uint16_t count;            // instructions in the block, including the terminator
+    DecodedInst *ops;
+    DecodedInst *fused;        // copy of ops with superinstructions, once the block is hot
+    int fusedTerminator;       // fused ends with a compare-and-branch covering two instructions
+    uint8_t fusionSites[FUSION_KINDS];
+    struct Block *taken;       // successor when the terminator transfers control
+    struct Block *fallthrough; // successor at startPc + 2 * count
+    struct Block *indirect;    // last target of a terminating jr/jalr
+    struct Block *allNext;     // list of all translated blocks, for flushing
+    void **slotTargets;        // dispatch label per slot of the ops run, once interpreted
+    uint64_t execCount;        // interpreted executions, for the fusion and JIT thresholds
+    uint64_t fusedExecs;       // executions of the fused copy, for --fusion-stats
+    void *jitCode;             // compiled native code, if any
+} Block;
+
+static inline int isBlockTerminator(uint8_t op) {
+    return (op >= OP_BEQ && op <= OP_BGEU) || op == OP_J || op == OP_JAL ||
+           op == OP_JR || op == OP_JALR || op == OP_ECALL;
+}
+
+static Block *translateBlock(Z16Machine *m, uint16_t startPc) {
+    DecodedInst ops[MAX_BLOCK_INSTS];
+    int count = 0;
+    uint16_t addr = startPc;
+
+    while (1) {
+        DecodedInst d = decodeInstruction(loadWord(m, addr));
+        ops[count++] = d;
+        m->blockCodeWords[addr >> 1] = 1;
+        if (isBlockTerminator(d.op) || count == MAX_BLOCK_INSTS || addr == MEM_SIZE - 2)
+            break;
+        addr += 2;
+    }
+
+    Block *b = (Block *)calloc(1, sizeof(Block));
+    b->startPc = startPc;
+    b->count = count;
+    b->ops = (DecodedInst *)malloc(count * sizeof(DecodedInst));
+    memcpy(b->ops, ops, count * sizeof(DecodedInst));
+    b->allNext = m->blockList;
+    m->blockList = b;
+    m->blockMap[startPc >> 1] = b;
+    return b;
+}
+
+static inline Block *lookupBlock(Z16Machine *m, uint16_t addr) {
+    Block *b = m->blockMap[addr >> 1];
+    return b ? b : translateBlock(m, addr);
+}
+
+// -----------------------
+// Superinstruction Fusion
+// -----------------------
+//
+// When an interpreted block has run FUSION_THRESHOLD times, it is scanned once for these
+// instruction pairs, and each one found is rewritten as a single superinstruction:
+//   lui rd, hi; addi rd, lo          -> rd = hi + lo, folded at fusion time
+//   addi rd, k; sw rs2, off(rd)      -> adjust the base and store in one step (stack pushes)
+//   slt/sltu rd, rs2; bz/bnz rd, off -> compare and branch, as the block terminator
+// Fusing only blocks that have proved hot keeps the cost away from code that runs a few
+// times. The rewritten copy keeps one slot per instruction, so instruction addresses
+// and counts stay the same. The first slot of a pair holds the superinstruction and the
+// second is skipped. The original ops are kept for the JIT. --fusion-stats reports, per
+// pattern, how many sites were fused and how many times they ran.
+#define FUSION_THRESHOLD 16
+
+static void fuseBlock(Block *b) {
+    const DecodedInst *ops = b->ops;
+    int n = b->count;
+    DecodedInst *f = (DecodedInst *)malloc(n * sizeof(DecodedInst));
+    memcpy(f, ops, n * sizeof(DecodedInst));
+    int sites = 0;
+
+    // Pairs inside the body; the last instruction always runs on its own
+    int i = 0;
+    while (i + 1 < n - 1) {
+        const DecodedInst *a = &ops[i], *c = &ops[i + 1];
+        if (a->op == OP_LUI && c->op == OP_ADDI && c->rd == a->rd) {
+            f[i].op = OP_FUSED_LUI_ADDI;
+            f[i].imm = (int16_t)(a->imm + c->imm);
+            b->fusionSites[FUSION_LUI_ADDI]++;
+        } else if (a->op == OP_ADDI && c->op == OP_SW && c->rd == a->rd) {
+            f[i].op = OP_FUSED_ADDI_SW;
+            f[i].rs2 = c->rs2;
+            f[i].imm = (int16_t)((a->imm & 0xFF) | (uint16_t)((uint16_t)c->imm << 8));
+            b->fusionSites[FUSION_ADDI_SW]++;
+        } else {
+            i++;
+            continue;
+        }
+        sites++;
+        i += 2;
+    }
+
+    // Compare feeding the terminating bz/bnz, unless a pair above already took it
+    const DecodedInst *cmp = &ops[n >= 2 ? n - 2 : 0], *br = &ops[n - 1];
+    if (n >= 2 && i <= n - 2 && (cmp->op == OP_SLT || cmp->op == OP_SLTU) &&
+        (br->op == OP_BZ || br->op == OP_BNZ) && br->rd == cmp->rd) {
+        f[n - 2].op = (cmp->op == OP_SLT ? OP_FUSED_SLT_BZ : OP_FUSED_SLTU_BZ) + (br->op == OP_BNZ);
+        f[n - 2].imm = br->imm;
+        b->fusedTerminator = 1;
+        b->fusionSites[FUSION_SLT_BRANCH]++;
+        sites++;
+    }
+
+    if (sites) {
+        b->fused = f;
+        free(b->slotTargets); // resolved for the plain ops
+        b->slotTargets = NULL;
+    } else {
+        free(f);
+    }
+}
+
+// Runs the body of an interpreted block, every slot before the terminator, from 'ops' (the
+// block's fused or plain ops). With computed goto, the first run looks up each slot's
+// handler label into b->slotTargets and gives the terminator's slot the exit label, so a
+// slot costs one indirect jump and no bounds check, as in runThreaded. Other compilers
+// switch on the op. Returns the slot where execution stopped: the terminator, or the slot
+// after a store into translated code.
+static const DecodedInst *runBlockBody(Z16Machine *m, Block *b, const DecodedInst *ops) {
+    const DecodedInst *d = ops;
+    const DecodedInst *last = ops + b->count - 1 - b->fusedTerminator;
+
+#if Z16_COMPUTED_GOTO
+    // Control transfers only ever end a block; they share the illegal-op label
+    static void *const labels[OP_FUSED_SLTU_BNZ + 1] = {
+        &&L_OP_ILLEGAL, &&L_OP_ILLEGAL,
+        &&L_OP_ADD, &&L_OP_SUB, &&L_OP_SLT, &&L_OP_SLTU, &&L_OP_SLL, &&L_OP_SRL, &&L_OP_SRA,
+        &&L_OP_OR, &&L_OP_AND, &&L_OP_XOR, &&L_OP_MV,
+        &&L_OP_ILLEGAL, &&L_OP_ILLEGAL,
+        &&L_OP_ADDI, &&L_OP_SLTI, &&L_OP_SLTUI, &&L_OP_SLLI, &&L_OP_SRLI, &&L_OP_SRAI,
+        &&L_OP_ORI, &&L_OP_ANDI, &&L_OP_XORI, &&L_OP_LI,
+        &&L_OP_ILLEGAL, &&L_OP_ILLEGAL, &&L_OP_ILLEGAL, &&L_OP_ILLEGAL,
+        &&L_OP_ILLEGAL, &&L_OP_ILLEGAL, &&L_OP_ILLEGAL, &&L_OP_ILLEGAL,
+        &&L_OP_SB, &&L_OP_SW,
+        &&L_OP_LB, &&L_OP_LW, &&L_OP_LBU,
+        &&L_OP_ILLEGAL, &&L_OP_ILLEGAL,
+        &&L_OP_LUI, &&L_OP_AUIPC,
+        &&L_OP_ILLEGAL,
+        &&L_OP_FUSED_LUI_ADDI, &&L_OP_FUSED_ADDI_SW,
+        &&L_OP_ILLEGAL, &&L_OP_ILLEGAL, &&L_OP_ILLEGAL, &&L_OP_ILLEGAL,
+    };
+    if (!b->slotTargets) {
+        b->slotTargets = (void **)malloc(b->count * sizeof(void *));
+        for (int i = 0; i < b->count; i++)
+            b->slotTargets[i] = labels[ops[i].op];
+        b->slotTargets[last - ops] = &&L_END;
+    }
+    void *const *target = b->slotTargets;
+#define DISPATCH() goto **target
+#define TARGET(op) case op: L_##op
+#define NEXT(n) do { d += (n); target += (n); DISPATCH(); } while (0)
+#else
+#define DISPATCH() goto dispatch_op
+#define TARGET(op) case op
+#define NEXT(n) do { d += (n); DISPATCH(); } while (0)
+#endif
+
+    DISPATCH();
+#if !Z16_COMPUTED_GOTO
+dispatch_op:
+    if (d == last)
+        return d;
+#endif
+    switch (d->op) {
+#define DATA_OP_TARGET(op)                                              \
+        TARGET(op):                                                     \
+            dataOp<op>(m, d, b->startPc + 2 * (d - ops));               \
+            if ((op == OP_SB || op == OP_SW) && m->codeModified)        \
+                return d + 1;                                           \
+            NEXT(1);
+        DATA_OP_CASES(DATA_OP_TARGET)
+#undef DATA_OP_TARGET
+        TARGET(OP_FUSED_LUI_ADDI):
+            m->regs[d->rd] = d->imm;
+            NEXT(2);
+        TARGET(OP_FUSED_ADDI_SW): {
+            uint16_t base = m->regs[d->rd] + (int8_t)(d->imm & 0xFF);
+            m->regs[d->rd] = base;
+            storeWord(m, base + (d->imm >> 8), m->regs[d->rs2]);
+            if (m->codeModified)
+                return d + 2;
+            NEXT(2);
+        }
+        TARGET(OP_ILLEGAL): // ignored
+        default:
+            NEXT(1);
+    }
+#if Z16_COMPUTED_GOTO
+L_END:
+#endif
+    return d;
+
+#undef DISPATCH
+#undef TARGET
+#undef NEXT
+}
+
+// Runs a fused compare-and-branch terminator. Returns whether the branch is taken.
+static inline int executeFusedBranch(Z16Machine *m, const DecodedInst *d) {
+    uint16_t *rd = &m->regs[d->rd];
+    uint16_t rs2 = m->regs[d->rs2];
+    if (d->op <= OP_FUSED_SLT_BNZ)
+        *rd = (int16_t)*rd < (int16_t)rs2;
+    else
+        *rd = *rd < rs2;
+    return (d->op == OP_FUSED_SLT_BNZ || d->op == OP_FUSED_SLTU_BNZ) ? *rd != 0 : *rd == 0;
+}
+
+// Adds the counts of a block about to be discarded to the machine totals.
+static void retireFusionStats(Z16Machine *m, const Block *b) {
+    if (!b->fused)
+        return;
+    for (int k = 0; k < FUSION_KINDS; k++) {
+        m->fusedSites[k] += b->fusionSites[k];
+        m->fusedRuns[k] += b->fusionSites[k] * b->fusedExecs;
+    }
+}
+
+// Prints the fusion counts of every block translated so far to stderr.
+void printFusionStats(Z16Machine *m) {
+    uint64_t sites[FUSION_KINDS], runs[FUSION_KINDS];
+    memcpy(sites, m->fusedSites, sizeof(sites));
+    memcpy(runs, m->fusedRuns, sizeof(runs));
+    for (const Block *b = m->blockList; b; b = b->allNext) {
+        if (!b->fused)
+            continue;
+        for (int k = 0; k < FUSION_KINDS; k++) {
+            sites[k] += b->fusionSites[k];
+            runs[k] += b->fusionSites[k] * b->fusedExecs;
+        }
     }
+    fprintf(stderr, "%-12s %8s %14s\n", "fusion", "sites", "executions");
+    for (int k = 0; k < FUSION_KINDS; k++)
+        fprintf(stderr, "%-12s %8llu %14llu\n", fusionNames[k], (unsigned long long)sites[k],
+                (unsigned long long)runs[k]);
+}
+
+// -----------------------
+// x86-64 JIT
+// -----------------------
+//
+// Blocks run by the block engine count their executions; once a block reaches the
+// machine's jitThreshold it is compiled to native x86-64 code. Inside compiled code the eight guest
+// registers live in host registers (loaded on entry, written back on exit, only for the
+// registers the block uses) and loads/stores address the memory[] base passed in rdi.
+// Guest 16-bit arithmetic is done with 16-bit host operations so the upper halves of the
+// pinned registers stay zero. A terminating ecall is left to the interpreter: the compiled
+// code returns just before it. A store into translated code leaves the compiled block
+// right after the storing instruction so the caller can flush (self-modifying code).
+//
+// Compiled code returns (exit kind << 16) | next PC.
+#if defined(__x86_64__) && (defined(__linux__) || defined(__APPLE__) || defined(__FreeBSD__))
+#define Z16_JIT 1
+#include <sys/mman.h>
+#else
+#define Z16_JIT 0
+#endif
+
+enum { JIT_EXIT_FALLTHROUGH, JIT_EXIT_TAKEN, JIT_EXIT_INDIRECT, JIT_EXIT_STORE, JIT_EXIT_ECALL };
+typedef uint32_t (*JitFn)(uint8_t *mem, uint16_t *regs);
+
+#if Z16_JIT
+#define JIT_BUFFER_SIZE (4 << 20) // per machine
+#define JIT_MAX_BLOCK_BYTES (MAX_BLOCK_INSTS * 176 + 256) // worst case for one block
+
+enum { RAX = 0, RCX, RDX, RBX, RSP, RBP, RSI, RDI, R8, R9, R10, R11, R12, R13, R14, R15 };
+
+// Host register pinned to each guest register x0..x7.
+static const uint8_t jitGuestReg[8] = {RBX, RBP, R12, R13, R14, R15, R8, R9};
+
+// Code emission state for one block being compiled.
+typedef struct {
+    uint8_t *p; // next byte to emit
+    // Exit sites waiting for the epilogue address (rel32 of a jmp).
+    uint8_t *epiloguePatches[MAX_BLOCK_INSTS * 4 + 4];
+    int epiloguePatchCount;
+    // Self-modifying-code exits: jne site and the PC to resume at.
+    uint8_t *storePatches[MAX_BLOCK_INSTS * 2];
+    uint16_t storeResume[MAX_BLOCK_INSTS * 2];
+    int storePatchCount;
+    uint64_t *dirtyPages; // the machine's dirty-page bitmap and page shift
+    int dirtyShift;
+    DecodedInst *decodeCache; // the machine's predecode cache
+} JitEmitter;
+
+static inline void emit8(JitEmitter *e, uint8_t b) { *e->p++ = b; }
+static inline void emit16(JitEmitter *e, uint16_t v) { memcpy(e->p, &v, 2); e->p += 2; }
+static inline void emit32(JitEmitter *e, uint32_t v) { memcpy(e->p, &v, 4); e->p += 4; }
+static inline void emit64(JitEmitter *e, uint64_t v) { memcpy(e->p, &v, 8); e->p += 8; }
+
+// REX prefix for a ModRM 'reg' field and 'rm'/base field (and optional SIB index).
+// 'force' emits an empty REX so byte registers select spl/bpl/sil/dil, not ah..bh.
+static inline void emitRex(JitEmitter *e, int w, int reg, int index, int base, int force) {
+    uint8_t rex = 0x40 | (w << 3) | ((reg >> 3) << 2) | ((index >> 3) << 1) | (base >> 3);
+    if (rex != 0x40 || force)
+        emit8(e, rex);
+}
+
+// <op> r/m, reg with a register operand; 'size16' adds the operand-size prefix.
+static void emitRR(JitEmitter *e, int size16, uint8_t opc, int rm, int reg) {
+    if (size16)
+        emit8(e, 0x66);
+    emitRex(e, 0, reg, 0, rm, 0);
+    emit8(e, opc);
+    emit8(e, 0xC0 | ((reg & 7) << 3) | (rm & 7));
+}
+
+// Group-1 ALU op (/ext: 0 add, 1 or, 4 and, 5 sub, 6 xor, 7 cmp) r/m16, imm16.
+static void emitAluImm16(JitEmitter *e, int ext, int rm, uint16_t imm) {
+    emit8(e, 0x66);
+    emitRex(e, 0, 0, 0, rm, 0);
+    emit8(e, 0x81);
+    emit8(e, 0xC0 | (ext << 3) | (rm & 7));
+    emit16(e, imm);
+}
+
+static void emitMovImm16(JitEmitter *e, int reg, uint16_t imm) {
+    emit8(e, 0x66);
+    emitRex(e, 0, 0, 0, reg, 0);
+    emit8(e, 0xB8 | (reg & 7));
+    emit16(e, imm);
+}
+
+static void emitMovImm32(JitEmitter *e, int reg, uint32_t imm) {
+    emitRex(e, 0, 0, 0, reg, 0);
+    emit8(e, 0xB8 | (reg & 7));
+    emit32(e, imm);
+}
+
+// movzx r32, r/m16 (register form)
+static void emitMovzx16(JitEmitter *e, int dst, int src) {
+    emitRex(e, 0, dst, 0, src, 0);
+    emit8(e, 0x0F);
+    emit8(e, 0xB7);
+    emit8(e, 0xC0 | ((dst & 7) << 3) | (src & 7));
+}
+
+// ModRM + SIB for [rdi + rax]
+static inline void emitMemRdiRax(JitEmitter *e, int reg) {
+    emit8(e, 0x04 | ((reg & 7) << 3));
+    emit8(e, 0x07);
+}
+
+// Computes the guest address regs[base] + imm (mod 64K) into eax.
+static void emitAddress(JitEmitter *e, int base, int16_t imm) {
+    emitRR(e, 0, 0x89, RAX, jitGuestReg[base]);
+    if (imm != 0)
+        emitAluImm16(e, 0, RAX, (uint16_t)imm);
+}
+
+// setcc al; movzx eax, al; mov rd16, ax
+static void emitSetFlag(JitEmitter *e, uint8_t cc, int rd) {
+    emit8(e, 0x0F); emit8(e, 0x90 | cc); emit8(e, 0xC0);
+    emit8(e, 0x0F); emit8(e, 0xB6); emit8(e, 0xC0);
+    emitRR(e, 1, 0x89, jitGuestReg[rd], RAX);
+}
+
+// mov eax, (kind << 16) | nextPc; jmp epilogue
+static void emitExit(JitEmitter *e, int kind, uint16_t nextPc) {
+    emitMovImm32(e, RAX, ((uint32_t)kind << 16) | nextPc);
+    emit8(e, 0xE9);
+    e->epiloguePatches[e->epiloguePatchCount++] = e->p;
+    emit32(e, 0);
+}
 
-    loadMemoryFromFile(argv[1]);
-    memset(regs, 0, sizeof(regs)); // initialize registers to 0
-    pc = 0; // starting at address 0
+// Leaves the block if the guest address in 'addrReg' lies in translated code:
+// mov ecx, addr; shr ecx, 1; cmp byte [r11 + rcx], 0; jne exit
+static void emitCodeWriteCheck(JitEmitter *e, int addrReg, uint16_t resumePc) {
+    emitRR(e, 0, 0x89, RCX, addrReg);
+    emit8(e, 0xD1); emit8(e, 0xE9);
+    emit8(e, 0x41); emit8(e, 0x80); emit8(e, 0x3C); emit8(e, 0x0B); emit8(e, 0x00);
+    emit8(e, 0x0F); emit8(e, 0x85);
+    e->storePatches[e->storePatchCount] = e->p;
+    e->storeResume[e->storePatchCount++] = resumePc;
+    emit32(e, 0);
+}
+
+// Marks the page of the guest address in 'addrReg' dirty:
+// mov ecx, addr; shr ecx, dirtyShift; mov rdx, dirtyPages; bts [rdx], ecx
+static void emitDirtyMark(JitEmitter *e, int addrReg) {
+    emitRR(e, 0, 0x89, RCX, addrReg);
+    emit8(e, 0xC1); emit8(e, 0xE9); emit8(e, (uint8_t)e->dirtyShift);
+    emit8(e, 0x48); emit8(e, 0xBA); emit64(e, (uint64_t)(uintptr_t)e->dirtyPages);
+    emit8(e, 0x0F); emit8(e, 0xAB); emit8(e, 0x0A);
+}
+
+// Drops the predecoded copy of the word holding the guest address in 'addrReg', as
+// storeByte does: mov ecx, addr; shr ecx, 1; imul ecx, ecx, sizeof(DecodedInst);
+// mov rdx, decodeCache; mov byte [rdx + rcx], OP_UNDECODED (op is the first field)
+static void emitDecodeInvalidate(JitEmitter *e, int addrReg) {
+    static_assert(sizeof(DecodedInst) < 128 && offsetof(DecodedInst, op) == 0, "imm8 entry size, op first");
+    emitRR(e, 0, 0x89, RCX, addrReg);
+    emit8(e, 0xD1); emit8(e, 0xE9);
+    emit8(e, 0x6B); emit8(e, 0xC9); emit8(e, (uint8_t)sizeof(DecodedInst));
+    emit8(e, 0x48); emit8(e, 0xBA); emit64(e, (uint64_t)(uintptr_t)e->decodeCache);
+    emit8(e, 0xC6); emit8(e, 0x04); emit8(e, 0x0A); emit8(e, OP_UNDECODED);
+}
+
+static inline void patchRel32(uint8_t *site, uint8_t *target) {
+    int32_t rel = (int32_t)(target - (site + 4));
+    memcpy(site, &rel, 4);
+}
+
+static int jitInit(Z16Machine *m) {
+    if (m->jitBuffer)
+        return 1;
+    void *p = mmap(NULL, JIT_BUFFER_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED)
+        return 0;
+    m->jitBuffer = m->jitPtr = (uint8_t *)p;
+    return 1;
+}
+
+// Drops all compiled code (called when the translated blocks are flushed).
+static void jitReset(Z16Machine *m) {
+    m->jitPtr = m->jitBuffer;
+}
+
+static void jitRelease(Z16Machine *m) {
+    if (m->jitBuffer)
+        munmap(m->jitBuffer, JIT_BUFFER_SIZE);
+    m->jitBuffer = m->jitPtr = NULL;
+}
+
+// Emits one non-control-flow instruction at 'instPc'.
+static void jitEmitDataOp(JitEmitter *e, const DecodedInst *d, uint16_t instPc) {
+    int rd = jitGuestReg[d->rd];
+    int rs2 = jitGuestReg[d->rs2];
+    uint16_t imm = (uint16_t)d->imm;
+
+    switch (d->op) {
+        case OP_ADD: emitRR(e, 1, 0x01, rd, rs2); break;
+        case OP_SUB: emitRR(e, 1, 0x29, rd, rs2); break;
+        case OP_OR:  emitRR(e, 1, 0x09, rd, rs2); break;
+        case OP_AND: emitRR(e, 1, 0x21, rd, rs2); break;
+        case OP_XOR: emitRR(e, 1, 0x31, rd, rs2); break;
+        case OP_MV:  emitRR(e, 1, 0x89, rd, rs2); break;
+        case OP_SLT:  emitRR(e, 1, 0x39, rd, rs2); emitSetFlag(e, 0xC, d->rd); break; // setl
+        case OP_SLTU: emitRR(e, 1, 0x39, rd, rs2); emitSetFlag(e, 0x2, d->rd); break; // setb
+        case OP_SLL: case OP_SRL: case OP_SRA: {
+            int ext = d->op == OP_SLL ? 4 : d->op == OP_SRL ? 5 : 7;
+            emitRR(e, 0, 0x89, RCX, rs2);                 // mov ecx, rs2
+            emit8(e, 0x83); emit8(e, 0xE1); emit8(e, 0x0F);     // and ecx, 15
+            emit8(e, 0x66);
+            emitRex(e, 0, 0, 0, rd, 0);
+            emit8(e, 0xD3); emit8(e, 0xC0 | (ext << 3) | (rd & 7)); // shl/shr/sar r16, cl
+            break;
+        }
 
-    char disasmBuf[128];
+        case OP_ADDI: emitAluImm16(e, 0, rd, imm); break;
+        case OP_ORI:  emitAluImm16(e, 1, rd, imm); break;
+        case OP_ANDI: emitAluImm16(e, 4, rd, imm); break;
+        case OP_XORI: emitAluImm16(e, 6, rd, imm); break;
+        case OP_SLTI:  emitAluImm16(e, 7, rd, imm); emitSetFlag(e, 0xC, d->rd); break;
+        case OP_SLTUI: emitAluImm16(e, 7, rd, imm); emitSetFlag(e, 0x2, d->rd); break;
+        case OP_SLLI: case OP_SRLI: case OP_SRAI: {
+            int ext = d->op == OP_SLLI ? 4 : d->op == OP_SRLI ? 5 : 7;
+            if (imm == 0)
+                break;
+            emit8(e, 0x66);
+            emitRex(e, 0, 0, 0, rd, 0);
+            emit8(e, 0xC1); emit8(e, 0xC0 | (ext << 3) | (rd & 7)); emit8(e, (uint8_t)imm);
+            break;
+        }
+        case OP_LI:
+        case OP_LUI:   emitMovImm16(e, rd, imm); break;
+        case OP_AUIPC: emitMovImm16(e, rd, (uint16_t)(instPc + imm)); break;
 
-    while (pc < MEM_SIZE) {
-        // Fetch a 16-bit instruction from memory (little-endian)
-        uint16_t inst = memory[pc] | (memory[pc + 1] << 8);
-        printf("0x%04X: ", pc);
-        disassemble(inst, pc, disasmBuf, sizeof(disasmBuf));
-        printf("\n");
+        case OP_LBU: // movzx rd32, byte [rdi + rax]
+            emitAddress(e, d->rs2, d->imm);
+            emitRex(e, 0, rd, 0, 0, 0);
+            emit8(e, 0x0F); emit8(e, 0xB6); emitMemRdiRax(e, rd);
+            break;
+        case OP_LB: // movsx rd16, byte [rdi + rax]
+            emitAddress(e, d->rs2, d->imm);
+            emit8(e, 0x66);
+            emitRex(e, 0, rd, 0, 0, 0);
+            emit8(e, 0x0F); emit8(e, 0xBE); emitMemRdiRax(e, rd);
+            break;
+        case OP_LW: // two byte loads so that address 0xFFFF wraps to 0x0000
+            emitAddress(e, d->rs2, d->imm);
+            emit8(e, 0x0F); emit8(e, 0xB6); emitMemRdiRax(e, RCX);  // movzx ecx, byte [rdi + rax]
+            emit8(e, 0x66); emit8(e, 0xFF); emit8(e, 0xC0);          // inc ax
+            emit8(e, 0x0F); emit8(e, 0xB6); emitMemRdiRax(e, RDX);  // movzx edx, byte [rdi + rax]
+            emit8(e, 0xC1); emit8(e, 0xE2); emit8(e, 0x08);          // shl edx, 8
+            emit8(e, 0x09); emit8(e, 0xD1);                       // or ecx, edx
+            emitRR(e, 1, 0x89, rd, RCX);                       // mov rd16, cx
+            break;
 
-        if (!executeInstruction(inst))
+        case OP_SB: // mov byte [rdi + rax], rs2b
+            emitAddress(e, d->rd, d->imm);
+            emitRex(e, 0, rs2, 0, 0, 1);
+            emit8(e, 0x88); emitMemRdiRax(e, rs2);
+            emitDirtyMark(e, RAX);
+            emitDecodeInvalidate(e, RAX);
+            emitCodeWriteCheck(e, RAX, instPc + 2);
+            break;
+        case OP_SW:
+            emitAddress(e, d->rd, d->imm);
+            emitRR(e, 0, 0x89, RDX, rs2);                      // mov edx, rs2
+            emitRR(e, 0, 0x89, R10, RAX);                      // mov r10d, eax
+            emit8(e, 0x88); emitMemRdiRax(e, RDX);               // mov [rdi + rax], dl
+            emit8(e, 0xC1); emit8(e, 0xEA); emit8(e, 0x08);          // shr edx, 8
+            emit8(e, 0x66); emit8(e, 0xFF); emit8(e, 0xC0);          // inc ax
+            emit8(e, 0x88); emitMemRdiRax(e, RDX);               // mov [rdi + rax], dl
+            emitDirtyMark(e, R10);
+            emitDirtyMark(e, RAX);
+            emitDecodeInvalidate(e, R10);
+            emitDecodeInvalidate(e, RAX);
+            emitCodeWriteCheck(e, R10, instPc + 2);
+            emitCodeWriteCheck(e, RAX, instPc + 2);
             break;
 
-        // Terminate if PC goes out of bounds
-        if (pc >= MEM_SIZE)
+        default: // OP_ILLEGAL
             break;
     }
+}
 
-    return 0;
+// Compiles block 'b'. Returns NULL when the code buffer is full.
+static JitFn jitCompile(Z16Machine *m, const Block *b) {
+    if (!m->jitBuffer || m->jitPtr + JIT_MAX_BLOCK_BYTES > m->jitBuffer + JIT_BUFFER_SIZE)
+        return NULL;
+
+    JitEmitter emitter;
+    JitEmitter *e = &emitter;
+    uint8_t *entry = m->jitPtr;
+    const DecodedInst *last = &b->ops[b->count - 1];
+    uint16_t lastPc = b->startPc + 2 * (b->count - 1);
+    int bodyCount = isBlockTerminator(last->op) ? b->count - 1 : b->count;
+    unsigned used = 0;
+    int hasStores = 0;
+
+    e->p = entry;
+    e->epiloguePatchCount = 0;
+    e->storePatchCount = 0;
+    e->dirtyPages = m->dirtyPages;
+    e->dirtyShift = m->dirtyShift;
+    e->decodeCache = m->decodeCache;
+    for (int i = 0; i < b->count; i++) {
+        used |= (1u << b->ops[i].rd) | (1u << b->ops[i].rs2);
+        if (b->ops[i].op == OP_SB || b->ops[i].op == OP_SW)
+            hasStores = 1;
+    }
+
+    // Prologue: save callee-saved registers, load the guest registers used by the block.
+    emit8(e, 0x53); emit8(e, 0x55);                                  // push rbx; push rbp
+    emit8(e, 0x41); emit8(e, 0x54); emit8(e, 0x41); emit8(e, 0x55); // push r12; push r13
+    emit8(e, 0x41); emit8(e, 0x56); emit8(e, 0x41); emit8(e, 0x57); // push r14; push r15
+    for (int r = 0; r < 8; r++) {
+        if (used & (1u << r)) { // movzx reg, word [rsi + 2 * r]
+            int h = jitGuestReg[r];
+            emitRex(e, 0, h, 0, RSI, 0);
+            emit8(e, 0x0F); emit8(e, 0xB7); emit8(e, 0x46 | ((h & 7) << 3)); emit8(e, 2 * r);
+        }
+    }
+    if (hasStores) { // mov r11, blockCodeWords
+        emit8(e, 0x49); emit8(e, 0xBB);
+        emit64(e, (uint64_t)(uintptr_t)m->blockCodeWords);
+    }
+
+    for (int i = 0; i < bodyCount; i++)
+        jitEmitDataOp(e, &b->ops[i], b->startPc + 2 * i);
+
+    if (bodyCount == b->count) {
+        emitExit(e, JIT_EXIT_FALLTHROUGH, lastPc + 2);
+    } else {
+        int rs1 = jitGuestReg[last->rd];
+        int rs2 = jitGuestReg[last->rs2];
+        uint16_t target = (lastPc + last->imm) & 0xFFFE;
+
+        switch (last->op) {
+            case OP_BEQ: case OP_BNE: case OP_BZ: case OP_BNZ:
+            case OP_BLT: case OP_BGE: case OP_BLTU: case OP_BGEU: {
+                static const uint8_t cc[8] = {0x4, 0x5, 0x4, 0x5, 0xC, 0xD, 0x2, 0x3};
+                if (last->op == OP_BZ || last->op == OP_BNZ)
+                    emitRR(e, 1, 0x85, rs1, rs1);           // test rs1, rs1
+                else
+                    emitRR(e, 1, 0x39, rs1, rs2);           // cmp rs1, rs2
+                emit8(e, 0x70 | cc[last->op - OP_BEQ]);     // jcc taken (skips the next exit)
+                emit8(e, 10);
+                emitExit(e, JIT_EXIT_FALLTHROUGH, lastPc + 2);
+                emitExit(e, JIT_EXIT_TAKEN, target);
+                break;
+            }
+            case OP_J:
+                emitExit(e, JIT_EXIT_TAKEN, target);
+                break;
+            case OP_JAL:
+                emitMovImm16(e, rs1, lastPc + 2);
+                emitExit(e, JIT_EXIT_TAKEN, target);
+                break;
+            case OP_JR:
+            case OP_JALR:
+                emitMovzx16(e, RAX, last->op == OP_JR ? rs1 : rs2);
+                emit8(e, 0x25); emit32(e, 0xFFFE);                       // and eax, 0xFFFE
+                if (last->op == OP_JALR)
+                    emitMovImm16(e, rs1, lastPc + 2);
+                emit8(e, 0x0D); emit32(e, (uint32_t)JIT_EXIT_INDIRECT << 16); // or eax, kind
+                emit8(e, 0xE9);
+                e->epiloguePatches[e->epiloguePatchCount++] = e->p;
+                emit32(e, 0);
+                break;
+            default: // OP_ECALL: stop in front of it
+                emitExit(e, JIT_EXIT_ECALL, lastPc);
+                break;
+        }
+    }
+
+    // Self-modifying-code exit stubs.
+    for (int i = 0; i < e->storePatchCount; i++) {
+        patchRel32(e->storePatches[i], e->p);
+        emitExit(e, JIT_EXIT_STORE, e->storeResume[i]);
+    }
+
+    // Epilogue: write the guest registers back and restore the host registers.
+    uint8_t *epilogue = e->p;
+    for (int i = 0; i < e->epiloguePatchCount; i++)
+        patchRel32(e->epiloguePatches[i], epilogue);
+    for (int r = 0; r < 8; r++) {
+        if (used & (1u << r)) { // mov word [rsi + 2 * r], reg16
+            int h = jitGuestReg[r];
+            emit8(e, 0x66);
+            emitRex(e, 0, h, 0, RSI, 0);
+            emit8(e, 0x89); emit8(e, 0x46 | ((h & 7) << 3)); emit8(e, 2 * r);
+        }
+    }
+    emit8(e, 0x41); emit8(e, 0x5F); emit8(e, 0x41); emit8(e, 0x5E); // pop r15; pop r14
+    emit8(e, 0x41); emit8(e, 0x5D); emit8(e, 0x41); emit8(e, 0x5C); // pop r13; pop r12
+    emit8(e, 0x5D); emit8(e, 0x5B);                                  // pop rbp; pop rbx
+    emit8(e, 0xC3);                                                  // ret
+
+    m->jitPtr = e->p;
+    return (JitFn)(void *)entry;
+}
+#else
+static int jitInit(Z16Machine *) { return 0; }
+static void jitReset(Z16Machine *) {}
+static void jitRelease(Z16Machine *) {}
+static JitFn jitCompile(Z16Machine *, const Block *) { return NULL; }
+#endif
+
+// Discards every translated block (and with them all chaining links).
+void flushBlocks(Z16Machine *m) {
+    while (m->blockList) {
+        Block *next = m->blockList->allNext;
+        retireFusionStats(m, m->blockList);
+        free(m->blockList->ops);
+        free(m->blockList->fused);
+        free(m->blockList->slotTargets);
+        free(m->blockList);
+        m->blockList = next;
+    }
+    if (m->blockMap) {
+        memset(m->blockMap, 0, (MEM_SIZE / 2) * sizeof(Block *));
+        memset(m->blockCodeWords, 0, MEM_SIZE / 2);
+    }
+    m->codeModified = 0;
+    jitReset(m);
+}
+
+// Runs from the current PC until ecall 3 or until execution runs past the end of memory.
+// With 'useJit', blocks that reach the machine's jitThreshold executions run as native code.
+void runBlocks(Z16Machine *m, int useJit) {
+    if (useJit && !jitInit(m)) {
+        fprintf(stderr, "JIT unavailable on this host; using the block interpreter\n");
+        useJit = 0;
+    }
+    if (!m->blockMap) {
+        m->blockMap = (Block **)calloc(MEM_SIZE / 2, sizeof(Block *));
+        m->blockCodeWords = (uint8_t *)calloc(MEM_SIZE / 2, 1);
+    }
+    if (m->codeModified) // translated code was overwritten while another engine ran
+        flushBlocks(m);
+
+    const uint64_t limit = m->instLimit ? m->instLimit : UINT64_MAX;
+    Block *b = lookupBlock(m, m->pc);
+
+    while (1) {
+        if (limit - m->instret < b->count) {
+            // The limit falls inside this block: finish instruction by instruction
+            while (m->instret < limit) {
+                m->instret++;
+                if (!executeInstruction(m, loadWord(m, m->pc)))
+                    return;
+            }
+            m->exitReason = EXIT_INST_LIMIT;
+            return;
+        }
+
+        uint16_t lastPc = b->startPc + 2 * (b->count - 1);
+        uint16_t nextPc = lastPc + 2;
+        Block **link = &b->fallthrough;
+
+        if (!b->jitCode) {
+            uint64_t runs = ++b->execCount;
+            if (useJit && runs >= (uint64_t)m->jitThreshold) {
+                b->jitCode = (void *)jitCompile(m, b);
+                if (!b->jitCode) { // code buffer full: start over with empty caches
+                    flushBlocks(m);
+                    b = lookupBlock(m, m->pc);
+                    continue;
+                }
+            } else if (runs == FUSION_THRESHOLD && m->fuse) {
+                fuseBlock(b);
+            }
+        }
+
+        if (b->jitCode) {
+            uint32_t result = ((JitFn)b->jitCode)(m->memory, m->regs);
+            int kind = result >> 16;
+            nextPc = result & 0xFFFF;
+            // A store exit resumes mid-block; every other exit ran the whole block
+            m->instret += kind == JIT_EXIT_STORE ? (uint16_t)(nextPc - b->startPc) / 2 : b->count;
+            if (kind == JIT_EXIT_TAKEN) {
+                link = &b->taken;
+            } else if (kind == JIT_EXIT_INDIRECT) {
+                link = &b->indirect;
+            } else {
+                if (kind == JIT_EXIT_ECALL) {
+                    if (!executeEcall(m, (uint16_t)b->ops[b->count - 1].imm)) {
+                        m->pc = lastPc;
+                        return;
+                    }
+                    nextPc = lastPc + 2;
+                } else if (kind == JIT_EXIT_STORE) {
+                    m->codeModified = 1;
+                }
+                if (nextPc == 0) { // sequential successor wrapped: ran past the end of memory
+                    m->pc = MEM_SIZE - 2;
+                    m->exitReason = EXIT_END_OF_MEMORY;
+                    return;
+                }
+            }
+        } else {
+            const DecodedInst *ops = b->ops;
+            if (b->fused) {
+                ops = b->fused;
+                b->fusedExecs++;
+            }
+            const DecodedInst *d = runBlockBody(m, b, ops);
+            if (m->codeModified) { // the block may have rewritten itself: stop here
+                nextPc = b->startPc + 2 * (d - ops);
+                link = NULL;
+            }
+            m->instret += link ? b->count : (uint32_t)(d - ops);
+
+            if (link) {
+                switch (d->op) {
+                    case OP_JR:
+                        nextPc = m->regs[d->rd] & 0xFFFE;
+                        link = &b->indirect;
+                        break;
+                    case OP_JALR:
+                        nextPc = m->regs[d->rs2] & 0xFFFE;
+                        m->regs[d->rd] = lastPc + 2;
+                        link = &b->indirect;
+                        break;
+                    case OP_BEQ: case OP_BNE: case OP_BZ: case OP_BNZ:
+                    case OP_BLT: case OP_BGE: case OP_BLTU: case OP_BGEU:
+                        if (branchTaken(m, d)) {
+                            nextPc = (lastPc + d->imm) & 0xFFFE;
+                            link = &b->taken;
+                        }
+                        break;
+                    case OP_FUSED_SLT_BZ: case OP_FUSED_SLT_BNZ:
+                    case OP_FUSED_SLTU_BZ: case OP_FUSED_SLTU_BNZ:
+                        if (executeFusedBranch(m, d)) {
+                            nextPc = (lastPc + d->imm) & 0xFFFE;
+                            link = &b->taken;
+                        }
+                        break;
+                    case OP_J:
+                        nextPc = (lastPc + d->imm) & 0xFFFE;
+                        link = &b->taken;
+                        break;
+                    case OP_JAL:
+                        nextPc = (lastPc + d->imm) & 0xFFFE;
+                        m->regs[d->rd] = lastPc + 2;
+                        link = &b->taken;
+                        break;
+                    case OP_ECALL:
+                        if (!executeEcall(m, (uint16_t)d->imm)) {
+                            m->pc = lastPc;
+                            return;
+                        }
+                        break;
+                    default:
+                        executeDataOp(m, d, lastPc);
+                        break;
+                }
+                if (link == &b->fallthrough && lastPc == MEM_SIZE - 2) {
+                    m->pc = lastPc; // ran past the end of memory
+                    m->exitReason = EXIT_END_OF_MEMORY;
+                    return;
+                }
+            }
+        }
+
+        m->pc = nextPc;
+        if (m->codeModified) {
+            flushBlocks(m);
+            b = lookupBlock(m, m->pc);
+            continue;
+        }
+
+        Block *next = *link;
+        if (!next || next->startPc != nextPc)
+            next = *link = lookupBlock(m, nextPc);
+        b = next;
+    }
+}
+
+// Returns the machine to its power-on state: zeroed registers, PC 0, no instructions
+// executed and empty caches. Memory and the instruction limit are left as is.
+void resetMachine(Z16Machine *m) {
+    memset(m->regs, 0, sizeof(m->regs));
+    m->pc = 0;
+    m->instret = 0;
+    m->exitReason = EXIT_NONE;
+    memset(m->decodeCache, 0, sizeof(m->decodeCache));
+    flushBlocks(m);
+}
+
+void destroyMachine(Z16Machine *m) {
+    flushBlocks(m);
+    free(m->blockMap);
+    if (m->blockCodeWords != noBlockCodeWords)
+        free(m->blockCodeWords);
+    jitRelease(m);
+    free(m->profile);
+    free(m->coverage);
+    releaseMemory(m->memory);
+    free(m);
+}
+
+// -----------------------
+// Memory Loading
+// -----------------------
+//
+// An image is opened once and then loaded into any number of machines without copying.
+// The image is held in a file of exactly MEM_SIZE bytes: the binary itself when it is that
+// large, otherwise an anonymous file holding the binary padded with zeroes. Loading maps
+// that file MAP_PRIVATE as the machine's memory, so every machine reads the same page-cache
+// pages and the kernel copies a page only when a machine first writes to it. Where mmap
+// is unavailable the image is a heap buffer that loading copies.
+typedef struct {
+    int fd;                    // MEM_SIZE-byte backing file, or -1 without mmap
+    const unsigned char *data; // read-only view of all MEM_SIZE bytes
+    size_t size;               // bytes taken from the binary
+} Z16Image;
+
+#if Z16_MMAP
+// Creates an unlinked, zero-filled file of MEM_SIZE bytes.
+static int createPaddedFile(void) {
+#if defined(__linux__)
+    int fd = memfd_create("z16image", MFD_CLOEXEC);
+#else
+    char path[] = "/tmp/z16imageXXXXXX";
+    int fd = mkstemp(path);
+    if (fd >= 0)
+        unlink(path);
+#endif
+    if (fd >= 0 && ftruncate(fd, MEM_SIZE) != 0) {
+        close(fd);
+        fd = -1;
+    }
+    return fd;
+}
+#endif
+
+// Opens the binary machine code image in 'filename'. Returns NULL (after reporting why)
+// if the file cannot be read.
+Z16Image *openImage(const char *filename) {
+    Z16Image *img = (Z16Image *)calloc(1, sizeof(Z16Image));
+#if Z16_MMAP
+    int fd = open(filename, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        perror("Error opening binary file");
+        if (fd >= 0)
+            close(fd);
+        free(img);
+        return NULL;
+    }
+    img->size = st.st_size < MEM_SIZE ? (size_t)st.st_size : MEM_SIZE;
+
+    void *data = MAP_FAILED;
+    if (img->size == MEM_SIZE) {
+        img->fd = fd;
+        data = mmap(NULL, MEM_SIZE, PROT_READ, MAP_SHARED, fd, 0);
+    } else if ((img->fd = createPaddedFile()) >= 0) {
+        // Pages past the end of a short binary cannot be mapped: copy it into the padded file
+        data = mmap(NULL, MEM_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, img->fd, 0);
+        size_t done = 0;
+        while (data != MAP_FAILED && done < img->size) {
+            ssize_t n = read(fd, (unsigned char *)data + done, img->size - done);
+            if (n <= 0)
+                break;
+            done += n;
+        }
+        img->size = done;
+        close(fd);
+        if (data != MAP_FAILED)
+            mprotect(data, MEM_SIZE, PROT_READ);
+    } else {
+        close(fd);
+    }
+    if (data == MAP_FAILED) {
+        perror("Error mapping binary file");
+        if (img->fd >= 0)
+            close(img->fd);
+        free(img);
+        return NULL;
+    }
+    img->data = (const unsigned char *)data;
+#else
+    FILE *fp = fopen(filename, "rb");
+    if (!fp) {
+        perror("Error opening binary file");
+        free(img);
+        return NULL;
+    }
+    unsigned char *data = (unsigned char *)calloc(1, MEM_SIZE);
+    img->size = fread(data, 1, MEM_SIZE, fp);
+    fclose(fp);
+    img->fd = -1;
+    img->data = data;
+#endif
+    return img;
+}
+
+// Closes the image. Machines that already loaded it keep their view of it.
+void closeImage(Z16Image *img) {
+#if Z16_MMAP
+    munmap((void *)img->data, MEM_SIZE);
+    close(img->fd);
+#else
+    free((void *)img->data);
+#endif
+    free(img);
+}
+
+// Makes 'img' the memory of 'm' and resets the machine.
+void loadImage(Z16Machine *m, const Z16Image *img) {
+#if Z16_MMAP
+    void *view = mmap(NULL, MEM_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE, img->fd, 0);
+    if (view != MAP_FAILED) {
+        munmap(m->memory, MEM_SIZE);
+        m->memory = (unsigned char *)view;
+    } else {
+        memcpy(m->memory, img->data, MEM_SIZE);
+    }
+#else
+    memcpy(m->memory, img->data, MEM_SIZE);
+#endif
+    memset(m->dirtyPages, 0, sizeof(m->dirtyPages));
+    resetMachine(m);
+}
+
+// -----------------------
+// Dirty Pages
+// -----------------------
+//
+// Every store sets the bit of its page in the machine's dirty-page bitmap (the JIT emits
+// the same bit-set), and loading an image clears it, so the set bits are exactly the pages
+// that may differ from the image. The page size is a power of two from DIRTY_PAGE_MIN to
+// DIRTY_PAGE_MAX bytes. Enumerating and resetting cost time in the number of dirty pages.
+#define DIRTY_PAGES_MAX (MEM_SIZE / DIRTY_PAGE_MIN)
+
+static inline uint32_t dirtyPageSize(const Z16Machine *m) {
+    return 1u << m->dirtyShift;
+}
+
+// Writes the numbers of the dirty pages, ascending, to 'pages' (room for DIRTY_PAGES_MAX)
+// and returns how many there are.
+uint32_t dirtyPageList(const Z16Machine *m, uint16_t *pages) {
+    uint32_t count = 0;
+    for (uint32_t w = 0; w < DIRTY_PAGES_MAX / 64; w++)
+        for (uint64_t bits = m->dirtyPages[w]; bits; bits &= bits - 1)
+            pages[count++] = (uint16_t)(w * 64 + __builtin_ctzll(bits));
+    return count;
+}
+
+static inline void markPageDirty(Z16Machine *m, uint32_t page) {
+    m->dirtyPages[page >> 6] |= 1ull << (page & 63);
+}
+
+// Changes the page size to 'bytes', carrying the dirty pages over. Returns 0 if 'bytes' is
+// not a power of two in range.
+int setDirtyPageSize(Z16Machine *m, uint32_t bytes) {
+    if (bytes < DIRTY_PAGE_MIN || bytes > DIRTY_PAGE_MAX || (bytes & (bytes - 1)))
+        return 0;
+    int shift = 0;
+    while ((1u << shift) < bytes)
+        shift++;
+    uint16_t pages[DIRTY_PAGES_MAX];
+    uint32_t count = dirtyPageList(m, pages);
+    int oldShift = m->dirtyShift;
+    memset(m->dirtyPages, 0, sizeof(m->dirtyPages));
+    m->dirtyShift = shift;
+    for (uint32_t i = 0; i < count; i++) {
+        uint32_t first = ((uint32_t)pages[i] << oldShift) >> shift;
+        uint32_t last = ((((uint32_t)pages[i] + 1) << oldShift) - 1) >> shift;
+        for (uint32_t page = first; page <= last; page++)
+            markPageDirty(m, page);
+    }
+    flushBlocks(m); // compiled stores mark pages with the old shift
+    return 1;
+}
+
+// Makes page 'page' of 'm' equal to 'contents', dropping the decoded entries of the words
+// that change. Returns 1 if one of them was translated code.
+static int restorePage(Z16Machine *m, uint32_t page, const unsigned char *contents) {
+    uint32_t size = dirtyPageSize(m);
+    unsigned char *dst = m->memory + page * size;
+    uint32_t firstSlot = page * size / 2;
+    int hadCode = 0;
+    for (uint32_t off = 0; off < size; off += 8) {
+        uint64_t have, want;
+        memcpy(&have, dst + off, 8);
+        memcpy(&want, contents + off, 8);
+        if (have == want)
+            continue;
+        memcpy(dst + off, contents + off, 8);
+        for (uint32_t slot = firstSlot + off / 2; slot < firstSlot + off / 2 + 4; slot++) {
+            m->decodeCache[slot].op = OP_UNDECODED;
+            hadCode |= m->blockCodeWords[slot];
+        }
+    }
+    return hadCode;
+}
+
+// Puts every dirty page of 'm' back to its contents in 'base', the image it was loaded
+// from, and clears the bitmap. Translated blocks are flushed only if restored words held
+// code.
+void resetDirtyPages(Z16Machine *m, const Z16Image *base) {
+    uint16_t pages[DIRTY_PAGES_MAX];
+    uint32_t count = dirtyPageList(m, pages);
+    int codeChanged = 0;
+    for (uint32_t i = 0; i < count; i++)
+        codeChanged |= restorePage(m, pages[i], base->data + pages[i] * dirtyPageSize(m));
+    memset(m->dirtyPages, 0, sizeof(m->dirtyPages));
+    if (codeChanged)
+        flushBlocks(m);
+}
+
+// -----------------------
+// Snapshots
+// -----------------------
+//
+// A snapshot is the architectural state of a machine (registers, PC, instruction count,
+// exit reason; the simulator models no devices) plus the memory pages that differ from the
+// image the machine was loaded from, at the machine's dirty-page size. Taking one looks only
+// at dirty pages. Restoring rewrites only the pages dirty in the machine or held by the
+// snapshot, and within them only the words that differ, so forking many runs from one
+// post-boot point is cheap. On disk a snapshot records the FNV-1a hash of its base image
+// and refuses any other base.
+#define SNAPSHOT_VERSION 1
+#define FNV_OFFSET 1469598103934665603ULL
+#define FNV_PRIME 1099511628211ULL
+
+typedef struct Z16Snapshot {
+    const Z16Image *base;
+    uint16_t regs[8];
+    uint16_t pc;
+    int exitReason;
+    uint64_t instret;
+    uint32_t pageSize;
+    uint32_t pageCount;
+    uint16_t *pageIndex;  // pages that differ from the base, ascending
+    unsigned char *pages; // pageCount * pageSize bytes
+} Z16Snapshot;
+
+static uint64_t imageHash(const Z16Image *img) {
+    uint64_t hash = FNV_OFFSET;
+    for (size_t i = 0; i < MEM_SIZE; i++)
+        hash = (hash ^ img->data[i]) * FNV_PRIME;
+    return hash;
+}
+
+// Captures the state of 'm' as a delta against 'base', the image it was loaded from.
+Z16Snapshot *takeSnapshot(const Z16Machine *m, const Z16Image *base) {
+    Z16Snapshot *s = (Z16Snapshot *)calloc(1, sizeof(Z16Snapshot));
+    s->base = base;
+    memcpy(s->regs, m->regs, sizeof(s->regs));
+    s->pc = m->pc;
+    s->exitReason = m->exitReason;
+    s->instret = m->instret;
+    s->pageSize = dirtyPageSize(m);
+    uint16_t dirty[DIRTY_PAGES_MAX];
+    uint32_t count = dirtyPageList(m, dirty);
+    s->pageIndex = (uint16_t *)malloc(DIRTY_PAGES_MAX * sizeof(uint16_t));
+    for (uint32_t i = 0; i < count; i++) // a dirty page may have been written back to its old contents
+        if (memcmp(m->memory + dirty[i] * s->pageSize, base->data + dirty[i] * s->pageSize, s->pageSize) != 0)
+            s->pageIndex[s->pageCount++] = dirty[i];
+    s->pages = (unsigned char *)malloc((size_t)s->pageCount * s->pageSize + 1);
+    for (uint32_t i = 0; i < s->pageCount; i++)
+        memcpy(s->pages + (size_t)i * s->pageSize, m->memory + s->pageIndex[i] * s->pageSize, s->pageSize);
+    return s;
+}
+
+void freeSnapshot(Z16Snapshot *s) {
+    free(s->pageIndex);
+    free(s->pages);
+    free(s);
+}
+
+// Puts 'm', which must have been loaded from the snapshot's base image, into the state the
+// snapshot captured. Afterwards exactly the snapshot's pages are dirty.
+void restoreSnapshot(Z16Machine *m, const Z16Snapshot *s) {
+    if (dirtyPageSize(m) != s->pageSize)
+        setDirtyPageSize(m, s->pageSize);
+    uint16_t dirty[DIRTY_PAGES_MAX];
+    uint32_t count = dirtyPageList(m, dirty);
+    int codeChanged = 0;
+    uint32_t i = 0, j = 0;
+    while (i < count || j < s->pageCount) { // merge the two ascending page lists
+        uint32_t page;
+        const unsigned char *contents;
+        if (j < s->pageCount && (i == count || s->pageIndex[j] <= dirty[i])) {
+            page = s->pageIndex[j];
+            contents = s->pages + (size_t)j++ * s->pageSize;
+            if (i < count && dirty[i] == page)
+                i++;
+        } else {
+            page = dirty[i++];
+            contents = s->base->data + page * s->pageSize;
+        }
+        codeChanged |= restorePage(m, page, contents);
+    }
+    memset(m->dirtyPages, 0, sizeof(m->dirtyPages));
+    for (j = 0; j < s->pageCount; j++)
+        markPageDirty(m, s->pageIndex[j]);
+    if (codeChanged)
+        flushBlocks(m);
+    memcpy(m->regs, s->regs, sizeof(m->regs));
+    m->pc = s->pc;
+    m->exitReason = s->exitReason;
+    m->instret = s->instret;
+}
+
+typedef struct {
+    char magic[4];          // "Z16S"
+    uint8_t version;
+    uint8_t reserved[3];
+    uint64_t baseHash;      // FNV-1a of the base image's MEM_SIZE bytes
+    uint16_t regs[8];
+    uint16_t pc;
+    uint16_t pageSize;
+    uint32_t exitReason;
+    uint64_t instret;
+    uint32_t pageCount;     // followed by pageCount uint16_t page numbers, then the pages
+    uint32_t reserved2;
+} SnapshotHeader;
+
+// Writes 's' to 'path'. Returns 0 on success.
+int writeSnapshot(const Z16Snapshot *s, const char *path) {
+    FILE *fp = fopen(path, "wb");
+    if (!fp) {
+        perror("Error opening snapshot file");
+        return 1;
+    }
+    SnapshotHeader h = {};
+    memcpy(h.magic, "Z16S", 4);
+    h.version = SNAPSHOT_VERSION;
+    h.baseHash = imageHash(s->base);
+    memcpy(h.regs, s->regs, sizeof(h.regs));
+    h.pc = s->pc;
+    h.pageSize = (uint16_t)s->pageSize;
+    h.exitReason = (uint32_t)s->exitReason;
+    h.instret = s->instret;
+    h.pageCount = s->pageCount;
+    fwrite(&h, sizeof(h), 1, fp);
+    fwrite(s->pageIndex, sizeof(uint16_t), s->pageCount, fp);
+    fwrite(s->pages, s->pageSize, s->pageCount, fp);
+    int failed = ferror(fp); // a short fwrite sets the error flag
+    if (fclose(fp) != 0 || failed) {
+        perror("Error writing snapshot file");
+        return 1;
+    }
+    return 0;
+}
+
+// Reads a snapshot of a machine loaded from 'base' from 'path'. Returns NULL (after
+// reporting why) if the file is unreadable, malformed or was taken from another image.
+Z16Snapshot *readSnapshot(const char *path, const Z16Image *base) {
+    FILE *fp = fopen(path, "rb");
+    if (!fp) {
+        perror("Error opening snapshot file");
+        return NULL;
+    }
+    SnapshotHeader h;
+    Z16Snapshot *s = (Z16Snapshot *)calloc(1, sizeof(Z16Snapshot));
+    const char *error = NULL;
+    if (fread(&h, sizeof(h), 1, fp) != 1 || memcmp(h.magic, "Z16S", 4) != 0 || h.version != SNAPSHOT_VERSION ||
+        h.pageSize < DIRTY_PAGE_MIN || h.pageSize > DIRTY_PAGE_MAX || (h.pageSize & (h.pageSize - 1)) ||
+        h.pageCount > MEM_SIZE / h.pageSize) {
+        error = "not a Z16 snapshot";
+    } else if (h.baseHash != imageHash(base)) {
+        error = "taken from a different image";
+    } else {
+        s->pageSize = h.pageSize;
+        s->pageCount = h.pageCount;
+        s->pageIndex = (uint16_t *)malloc(DIRTY_PAGES_MAX * sizeof(uint16_t));
+        s->pages = (unsigned char *)malloc((size_t)s->pageCount * s->pageSize + 1);
+        if (fread(s->pageIndex, sizeof(uint16_t), s->pageCount, fp) != s->pageCount ||
+            fread(s->pages, s->pageSize, s->pageCount, fp) != s->pageCount)
+            error = "truncated";
+        for (uint32_t i = 0; !error && i < s->pageCount; i++)
+            if (s->pageIndex[i] >= MEM_SIZE / s->pageSize || (i && s->pageIndex[i] <= s->pageIndex[i - 1]))
+                error = "corrupt page list";
+    }
+    fclose(fp);
+    if (error) {
+        fprintf(stderr, "Error reading snapshot %s: %s\n", path, error);
+        free(s->pageIndex);
+        free(s->pages);
+        free(s);
+        return NULL;
+    }
+    s->base = base;
+    memcpy(s->regs, h.regs, sizeof(s->regs));
+    s->pc = h.pc;
+    s->exitReason = (int)h.exitReason;
+    s->instret = h.instret;
+    return s;
+}
+
+// -----------------------
+// Record and Replay
+// -----------------------
+//
+// The only nondeterminism a program sees is what it reads from outside the machine
+// (InputFn). --record=PATH logs each value read and the instruction count it was read at.
+// --replay=PATH feeds the values back, so a failing run captured in production can be
+// rerun bit-exactly offline under traces, profiles or the models, on any engine.
+// Replay replaces only the InputFn, so engines keep running at full speed.
+//
+// The log is a header followed by one record per read. The header holds "Z16R", the
+// version, the FNV-1a hash of the image, and the starting instruction count (non-zero after
+// --restore). It also holds the final count and exit reason, filled in when the run ends.
+// Each record is two LEB128 varints: the instructions since the previous read, shifted
+// left by INPUT_SOURCE_BITS and ORed with the source, then the value. A byte read a few
+// instructions after the last one costs two or three bytes.
+//
+// Records are kept in memory and written when the run ends. A read at another instruction
+// count, of another source, or past the last record means the replay diverged. Such a read
+// sees the end of input, and the replay reports the point where it diverged.
+#define REPLAY_VERSION 1
+#define INPUT_SOURCE_BITS 2
+
+typedef struct {
+    char magic[4];
+    uint32_t version;
+    uint64_t imageHash;
+    uint64_t startInstret;
+    uint64_t endInstret;  // 0 if the run never finished
+    uint32_t exitReason;
+    uint32_t reserved;
+    uint64_t reads;
+    uint64_t bytes;       // of records following the header
+} ReplayHeader;
+
+typedef struct InputLog {
+    ReplayHeader header;
+    std::string records;
+    size_t pos;           // replay: offset of the next record
+    uint64_t lastInstret; // instruction count of the previous read
+    uint64_t divergedAt;  // replay: instruction count of the first mismatched read (0: none)
+    InputFn source;       // recording: where the values come from
+    void *sourceCtx;
+} InputLog;
+
+static void appendVarint(std::string *out, uint64_t v) {
+    while (v >= 0x80) {
+        out->push_back((char)(v | 0x80));
+        v >>= 7;
+    }
+    out->push_back((char)v);
+}
+
+static int readVarint(const std::string &in, size_t *pos, uint64_t *v) {
+    *v = 0;
+    for (int shift = 0; *pos < in.size() && shift < 64; shift += 7) {
+        uint8_t byte = (uint8_t)in[(*pos)++];
+        *v |= (uint64_t)(byte & 0x7F) << shift;
+        if (!(byte & 0x80))
+            return 1;
+    }
+    return 0;
+}
+
+static uint16_t recordInput(Z16Machine *m, int source) {
+    InputLog *log = (InputLog *)m->inputCtx;
+    uint16_t value = 0xFFFF;
+    if (log->source) {
+        m->inputCtx = log->sourceCtx;
+        value = log->source(m, source);
+        m->inputCtx = log;
+    }
+    appendVarint(&log->records, (m->instret - log->lastInstret) << INPUT_SOURCE_BITS | source);
+    appendVarint(&log->records, value);
+    log->lastInstret = m->instret;
+    log->header.reads++;
+    return value;
+}
+
+static uint16_t replayInput(Z16Machine *m, int source) {
+    InputLog *log = (InputLog *)m->inputCtx;
+    uint64_t delta, value;
+    size_t pos = log->pos;
+    if (!log->divergedAt && readVarint(log->records, &pos, &delta) && readVarint(log->records, &pos, &value) &&
+        (int)(delta & ((1 << INPUT_SOURCE_BITS) - 1)) == source &&
+        log->lastInstret + (delta >> INPUT_SOURCE_BITS) == m->instret) {
+        log->pos = pos;
+        log->lastInstret = m->instret;
+        return (uint16_t)value;
+    }
+    if (!log->divergedAt)
+        log->divergedAt = m->instret;
+    return 0xFFFF;
+}
+
+// Starts logging the reads of 'm', a machine loaded from 'img', passing them on to its
+// current InputFn.
+InputLog *startRecording(Z16Machine *m, const Z16Image *img) {
+    InputLog *log = new InputLog();
+    memcpy(log->header.magic, "Z16R", 4);
+    log->header.version = REPLAY_VERSION;
+    log->header.imageHash = imageHash(img);
+    log->header.startInstret = log->lastInstret = m->instret;
+    log->source = m->input;
+    log->sourceCtx = m->inputCtx;
+    m->input = recordInput;
+    m->inputCtx = log;
+    return log;
+}
+
+// Ends the recording on 'm', noting where its run stopped, and gives the machine its
+// InputFn back.
+void stopRecording(Z16Machine *m, InputLog *log) {
+    log->header.endInstret = m->instret;
+    log->header.exitReason = (uint32_t)m->exitReason;
+    log->header.bytes = log->records.size();
+    m->input = log->source;
+    m->inputCtx = log->sourceCtx;
+}
+
+// Writes the log to 'path'. Returns 0 on success.
+int writeInputLog(const InputLog *log, const char *path) {
+    FILE *fp = fopen(path, "wb");
+    if (!fp) {
+        perror("Error opening replay log");
+        return 1;
+    }
+    fwrite(&log->header, sizeof(log->header), 1, fp);
+    fwrite(log->records.data(), 1, log->records.size(), fp);
+    int failed = ferror(fp); // a short fwrite sets the error flag
+    if (fclose(fp) != 0 || failed) {
+        perror("Error writing replay log");
+        return 1;
+    }
+    return 0;
+}
+
+// Reads the log of a run of 'img' from 'path'. Returns NULL (after reporting why) if the
+// file is unreadable, malformed or was recorded with another image.
+InputLog *readInputLog(const char *path, const Z16Image *img) {
+    FILE *fp = fopen(path, "rb");
+    if (!fp) {
+        perror("Error opening replay log");
+        return NULL;
+    }
+    InputLog *log = new InputLog();
+    const char *error = NULL;
+    ReplayHeader *h = &log->header;
+    if (fread(h, sizeof(*h), 1, fp) != 1 || memcmp(h->magic, "Z16R", 4) != 0 || h->version != REPLAY_VERSION ||
+        h->exitReason > EXIT_INST_LIMIT) {
+        error = "not a Z16 replay log";
+    } else if (h->imageHash != imageHash(img)) {
+        error = "recorded with a different image";
+    } else {
+        log->records.resize(h->bytes);
+        if (fread(&log->records[0], 1, h->bytes, fp) != h->bytes)
+            error = "truncated";
+    }
+    fclose(fp);
+    if (error) {
+        fprintf(stderr, "Error reading replay log %s: %s\n", path, error);
+        delete log;
+        return NULL;
+    }
+    return log;
+}
+
+// Makes 'm' read the logged values from now on. 'm' must be in the state the recorded
+// run started from.
+void startReplay(Z16Machine *m, InputLog *log) {
+    log->pos = 0;
+    log->lastInstret = log->header.startInstret;
+    log->divergedAt = 0;
+    m->input = replayInput;
+    m->inputCtx = log;
+}
+
+// Ends a replay on 'm'. Returns 1 if it read exactly the logged values and stopped where
+// the recorded run did; otherwise reports the difference unless 'quiet'.
+int finishReplay(Z16Machine *m, InputLog *log, int quiet) {
+    m->input = NULL;
+    m->inputCtx = NULL;
+    const ReplayHeader *h = &log->header;
+    if (log->divergedAt) {
+        if (!quiet)
+            fprintf(stderr, "replay: diverged at instruction %llu\n", (unsigned long long)log->divergedAt);
+        return 0;
+    }
+    if (h->endInstret && (m->instret != h->endInstret || m->exitReason != (int)h->exitReason)) {
+        if (!quiet)
+            fprintf(stderr, "replay: stopped (%s) after %llu instructions, recorded run (%s) after %llu\n",
+                    exitNames[m->exitReason], (unsigned long long)m->instret, exitNames[h->exitReason],
+                    (unsigned long long)h->endInstret);
+        return 0;
+    }
+    if (log->pos != log->records.size()) {
+        if (!quiet)
+            fprintf(stderr, "replay: %zu bytes of the log were not read\n", log->records.size() - log->pos);
+        return 0;
+    }
+    return 1;
+}
+
+void freeInputLog(InputLog *log) {
+    delete log;
+}
+
+// -----------------------
+// Binary Trace
+// -----------------------
+//
+// A binary trace is an 8-byte header ("Z16T", version, record size) followed by one
+// fixed-size record per executed instruction. The record holds the PC, the raw
+// instruction word and the single architectural change it made. 'where' is the destination
+// register index for instructions that write rd, or the address for sb/sw. 'value' is the
+// new register value or the stored byte/word. Both are 0 for instructions that change
+// only the PC.
+//
+// Records go into a ring of large chunks. A background writer thread drains each filled
+// chunk to the file with one sequential fwrite, so the simulation thread only copies
+// 8 bytes per instruction. It only waits when the writer falls a whole ring behind.
+typedef struct {
+    uint16_t pc;
+    uint16_t inst;
+    uint16_t where;
+    uint16_t value;
+} TraceRecord;
+
+#define TRACE_VERSION 1
+#define TRACE_CHUNK_RECORDS (64 * 1024)
+#define TRACE_CHUNKS 4
+
+typedef struct TraceWriter {
+    FILE *fp;
+    TraceRecord *chunks[TRACE_CHUNKS];
+    size_t fill[TRACE_CHUNKS];  // records in each chunk handed to the writer (0 = free)
+    int current;                // chunk being filled by the simulation thread
+    size_t used;                // records in the current chunk
+    int stopping;
+    std::mutex lock;
+    std::condition_variable wake;
+    std::thread writer;
+} TraceWriter;
+
+static void traceWriterMain(TraceWriter *tw) {
+    int next = 0;
+    std::unique_lock<std::mutex> guard(tw->lock);
+    while (1) {
+        tw->wake.wait(guard, [&] { return tw->fill[next] != 0 || tw->stopping; });
+        if (tw->fill[next] == 0)
+            break; // stopping and fully drained
+        size_t count = tw->fill[next];
+        guard.unlock();
+        fwrite(tw->chunks[next], sizeof(TraceRecord), count, tw->fp);
+        guard.lock();
+        tw->fill[next] = 0;
+        tw->wake.notify_all();
+        next = (next + 1) % TRACE_CHUNKS;
+    }
+}
+
+// Opens 'path' for a binary trace and starts the writer thread. Returns NULL on failure.
+TraceWriter *openTraceWriter(const char *path) {
+    FILE *fp = fopen(path, "wb");
+    if (!fp) {
+        perror("Error opening trace file");
+        return NULL;
+    }
+    const char header[8] = {'Z', '1', '6', 'T', TRACE_VERSION, 0, sizeof(TraceRecord), 0};
+    fwrite(header, 1, sizeof(header), fp);
+
+    TraceWriter *tw = new TraceWriter();
+    tw->fp = fp;
+    for (int i = 0; i < TRACE_CHUNKS; i++) {
+        tw->chunks[i] = (TraceRecord *)malloc(TRACE_CHUNK_RECORDS * sizeof(TraceRecord));
+        tw->fill[i] = 0;
+    }
+    tw->current = 0;
+    tw->used = 0;
+    tw->stopping = 0;
+    tw->writer = std::thread(traceWriterMain, tw);
+    return tw;
+}
+
+// Hands the current chunk to the writer and moves to the next one, waiting if the writer
+// has not drained it yet.
+static void traceSubmitChunk(TraceWriter *tw) {
+    std::unique_lock<std::mutex> guard(tw->lock);
+    tw->fill[tw->current] = tw->used;
+    tw->wake.notify_all();
+    tw->current = (tw->current + 1) % TRACE_CHUNKS;
+    tw->used = 0;
+    tw->wake.wait(guard, [&] { return tw->fill[tw->current] == 0; });
+}
+
+static inline void traceAppend(TraceWriter *tw, uint16_t pc, uint16_t inst, uint16_t where, uint16_t value) {
+    TraceRecord *r = &tw->chunks[tw->current][tw->used];
+    r->pc = pc;
+    r->inst = inst;
+    r->where = where;
+    r->value = value;
+    if (++tw->used == TRACE_CHUNK_RECORDS)
+        traceSubmitChunk(tw);
+}
+
+// Flushes the remaining records, stops the writer thread and closes the file.
+void closeTraceWriter(TraceWriter *tw) {
+    if (tw->used)
+        traceSubmitChunk(tw);
+    {
+        std::lock_guard<std::mutex> guard(tw->lock);
+        tw->stopping = 1;
+        tw->wake.notify_all();
+    }
+    tw->writer.join();
+    fclose(tw->fp);
+    for (int i = 0; i < TRACE_CHUNKS; i++)
+        free(tw->chunks[i]);
+    delete tw;
+}
+
+// Operations whose trace record names a destination register.
+static inline int writesRd(uint8_t op) {
+    return (op >= OP_ADD && op <= OP_MV) || op == OP_JALR || (op >= OP_ADDI && op <= OP_LI) ||
+           (op >= OP_LB && op <= OP_LBU) || op == OP_JAL || op == OP_LUI || op == OP_AUIPC;
+}
+
+// Prints a binary trace as text, one line per record. Returns 0 on success.
+int decodeTraceFile(const char *path) {
+    FILE *fp = fopen(path, "rb");
+    if (!fp) {
+        perror("Error opening trace file");
+        return 1;
+    }
+    unsigned char header[8];
+    if (fread(header, 1, sizeof(header), fp) != sizeof(header) || memcmp(header, "Z16T", 4) != 0 ||
+        header[4] != TRACE_VERSION || header[6] != sizeof(TraceRecord)) {
+        fprintf(stderr, "%s: not a Z16 binary trace\n", path);
+        fclose(fp);
+        return 1;
+    }
+
+    static TraceRecord records[TRACE_CHUNK_RECORDS];
+    char line[256];
+    size_t n;
+    while ((n = fread(records, sizeof(TraceRecord), TRACE_CHUNK_RECORDS, fp)) > 0) {
+        for (size_t i = 0; i < n; i++) {
+            const TraceRecord *r = &records[i];
+            uint8_t op = decodeInstruction(r->inst).op;
+            int len = snprintf(line, sizeof(line), "0x%04X: ", r->pc);
+            len += disassemble(r->inst, r->pc, line + len, sizeof(line) - len);
+            if (op == OP_SB)
+                len += snprintf(line + len, sizeof(line) - len, "    mem[0x%04X] <- 0x%02X", r->where, r->value);
+            else if (op == OP_SW)
+                len += snprintf(line + len, sizeof(line) - len, "    mem[0x%04X] <- 0x%04X", r->where, r->value);
+            else if (writesRd(op))
+                len += snprintf(line + len, sizeof(line) - len, "    %s <- 0x%04X", regNames[r->where & 0x7], r->value);
+            line[len++] = '\n';
+            fwrite(line, 1, len, stdout);
+        }
+    }
+    fclose(fp);
+    return 0;
+}
+
+// -----------------------
+// Profiling
+// -----------------------
+//
+// --profile counts every executed instruction twice: by operation (the instruction mix)
+// and by address, in a flat array indexed by pc/2. Counting happens in the stepping loop
+// and is a template parameter of it, so runs without --profile contain no profiling code.
+// At exit the report lists the mix and the hottest addresses with their disassembly. The
+// disassembly is of memory as it is at exit.
+//
+// Loops are found from back-edges: taken B-type branches and j instructions with a
+// negative offset, counted by branch address. The only other per-instruction work is one
+// range check on those two kinds of instruction; basic blocks and loop bodies are
+// reconstructed from the counts when the report is written, so --profile stays cheap
+// enough to leave on.
+#define PROFILE_HOT_SPOTS 20
+#define PROFILE_HOT_BLOCKS 10
+#define PROFILE_HOT_LOOPS 10
+
+typedef struct Profile {
+    uint64_t pcCounts[MEM_SIZE / 2];
+    uint64_t backEdges[MEM_SIZE / 2]; // taken backward branches and jumps, by their address
+    uint64_t opCounts[OP_COUNT];
+} Profile;
+
+static inline void profileInstruction(Profile *prof, uint16_t pc, uint8_t op) {
+    prof->pcCounts[pc >> 1]++;
+    prof->opCounts[op]++;
+}
+
+// Called after 'd' at 'pc' has executed and moved the machine to 'nextPc'.
+static inline void profileBackEdge(Profile *prof, const DecodedInst *d, uint16_t pc, uint16_t nextPc) {
+    if (((d->op >= OP_BEQ && d->op <= OP_BGEU) || d->op == OP_J) && d->imm < 0 &&
+        nextPc == (uint16_t)(pc + d->imm))
+        prof->backEdges[pc >> 1]++;
+}
+
+// Basic blocks are rebuilt from the address counts: a block starts at an executed address
+// whose predecessor was not executed, ends a block, or ran a different number of times.
+// A branch into the middle of a straight run with identical counts is not split out.
+static void writeHotBlocks(const Z16Machine *m, FILE *out, uint64_t total) {
+    const Profile *prof = m->profile;
+    struct HotBlock { uint16_t start, length; uint64_t count, instructions; };
+    std::vector<HotBlock> blocks;
+    for (uint32_t slot = 0; slot < MEM_SIZE / 2; slot++) {
+        uint64_t count = prof->pcCounts[slot];
+        if (!count)
+            continue;
+        if (blocks.empty() || slot == 0 || prof->pcCounts[slot - 1] != count ||
+            isBlockTerminator(decodeInstruction(loadWord(m, (uint16_t)((slot - 1) << 1))).op))
+            blocks.push_back({(uint16_t)(slot << 1), 0, count, 0});
+        blocks.back().length++;
+        blocks.back().instructions += count;
+    }
+    size_t shown = blocks.size() < PROFILE_HOT_BLOCKS ? blocks.size() : PROFILE_HOT_BLOCKS;
+    std::partial_sort(blocks.begin(), blocks.begin() + shown, blocks.end(),
+                      [](const HotBlock &a, const HotBlock &b) {
+                          return a.instructions > b.instructions ||
+                                 (a.instructions == b.instructions && a.start < b.start);
+                      });
+
+    fprintf(out, "Hot blocks (%zu of %zu):\n", shown, blocks.size());
+    fprintf(out, "  %-13s %5s %14s %8s\n", "range", "insts", "executions", "share");
+    for (size_t i = 0; i < shown; i++) {
+        const HotBlock &b = blocks[i];
+        fprintf(out, "  0x%04X-0x%04X %5u %14llu %7.2f%%\n", b.start, (uint16_t)(b.start + 2 * (b.length - 1)),
+                b.length, (unsigned long long)b.count, 100.0 * b.instructions / total);
+    }
+}
+
+// A loop is the address range from a back-edge's target (the header) to the back-edge.
+// Every execution of the header is an iteration; entries are header executions that did
+// not arrive over a back-edge. The share counts every instruction inside the range, so an
+// outer loop includes its inner loops.
+static void writeHotLoops(const Z16Machine *m, FILE *out, uint64_t total) {
+    const Profile *prof = m->profile;
+    struct HotLoop { uint16_t header, latch; uint64_t iterations, entries, instructions; };
+    std::vector<HotLoop> loops;
+    std::vector<uint64_t> backIntoHeader(MEM_SIZE / 2);
+    for (uint32_t slot = 0; slot < MEM_SIZE / 2; slot++) {
+        if (!prof->backEdges[slot])
+            continue;
+        uint16_t latch = (uint16_t)(slot << 1);
+        uint16_t header = (uint16_t)(latch + decodeInstruction(loadWord(m, latch)).imm);
+        if (header > latch)
+            continue; // the branch was overwritten after it ran
+        loops.push_back({header, latch, prof->pcCounts[header >> 1], 0, 0});
+        backIntoHeader[header >> 1] += prof->backEdges[slot];
+    }
+    for (HotLoop &loop : loops) {
+        uint64_t back = backIntoHeader[loop.header >> 1];
+        loop.entries = loop.iterations > back ? loop.iterations - back : 1;
+        for (uint32_t slot = loop.header >> 1; slot <= (uint32_t)(loop.latch >> 1); slot++)
+            loop.instructions += prof->pcCounts[slot];
+    }
+    size_t shown = loops.size() < PROFILE_HOT_LOOPS ? loops.size() : PROFILE_HOT_LOOPS;
+    std::partial_sort(loops.begin(), loops.begin() + shown, loops.end(),
+                      [](const HotLoop &a, const HotLoop &b) {
+                          return a.instructions > b.instructions ||
+                                 (a.instructions == b.instructions && a.header < b.header);
+                      });
+
+    fprintf(out, "Hot loops (%zu of %zu):\n", shown, loops.size());
+    fprintf(out, "  %-13s %14s %12s %12s %8s\n", "header-latch", "iterations", "entries", "avg trips", "share");
+    for (size_t i = 0; i < shown; i++) {
+        const HotLoop &loop = loops[i];
+        fprintf(out, "  0x%04X-0x%04X %14llu %12llu %12.1f %7.2f%%\n", loop.header, loop.latch,
+                (unsigned long long)loop.iterations, (unsigned long long)loop.entries,
+                (double)loop.iterations / loop.entries, 100.0 * loop.instructions / total);
+    }
+}
+
+// Writes the instruction mix, the PROFILE_HOT_SPOTS most executed addresses and the
+// hottest basic blocks and loops to 'out'.
+void writeProfileReport(const Z16Machine *m, FILE *out) {
+    const Profile *prof = m->profile;
+    uint64_t total = 0;
+    for (int op = 0; op < OP_COUNT; op++)
+        total += prof->opCounts[op];
+    if (total == 0)
+        total = 1; // nothing ran; avoid dividing by zero below
+
+    fprintf(out, "Instruction mix:\n");
+    int ops[OP_COUNT];
+    int numOps = 0;
+    for (int op = 0; op < OP_COUNT; op++)
+        if (prof->opCounts[op])
+            ops[numOps++] = op;
+    std::sort(ops, ops + numOps, [&](int a, int b) { return prof->opCounts[a] > prof->opCounts[b]; });
+    for (int i = 0; i < numOps; i++) {
+        int op = ops[i];
+        fprintf(out, "  %-8s %14llu  %6.2f%%\n", op == OP_ILLEGAL ? "illegal" : opNames[op],
+                (unsigned long long)prof->opCounts[op], 100.0 * prof->opCounts[op] / total);
+    }
+
+    std::vector<uint32_t> hot;
+    for (uint32_t slot = 0; slot < MEM_SIZE / 2; slot++)
+        if (prof->pcCounts[slot])
+            hot.push_back(slot);
+    size_t shown = hot.size() < PROFILE_HOT_SPOTS ? hot.size() : PROFILE_HOT_SPOTS;
+    std::partial_sort(hot.begin(), hot.begin() + shown, hot.end(), [&](uint32_t a, uint32_t b) {
+        return prof->pcCounts[a] > prof->pcCounts[b] || (prof->pcCounts[a] == prof->pcCounts[b] && a < b);
+    });
+
+    fprintf(out, "Hot spots (%zu of %zu addresses executed):\n", shown, hot.size());
+    fprintf(out, "  %-6s %14s %8s %8s  %s\n", "pc", "count", "share", "cumul", "instruction");
+    uint64_t cumulative = 0;
+    char text[64];
+    for (size_t i = 0; i < shown; i++) {
+        uint16_t pc = (uint16_t)(hot[i] << 1);
+        uint64_t count = prof->pcCounts[hot[i]];
+        cumulative += count;
+        disassemble(loadWord(m, pc), pc, text, sizeof(text));
+        fprintf(out, "  0x%04X %14llu %7.2f%% %7.2f%%  %s\n", pc, (unsigned long long)count,
+                100.0 * count / total, 100.0 * cumulative / total, text);
+    }
+
+    writeHotBlocks(m, out, total);
+    writeHotLoops(m, out, total);
+}
+
+// -----------------------
+// Call Stacks
+// -----------------------
+//
+// --flamegraph follows the guest call stack and writes folded stacks ("f;g;h count" lines,
+// as read by flamegraph.pl and speedscope). A jal or jalr that writes ra pushes a frame for
+// its target and jr ra pops one. Stacks are interned as a calling-context tree, so a push
+// or pop is one step in the tree and a sample is one counter increment on the current node.
+// Every instruction is a sample by default; --flamegraph-period=N samples every Nth one.
+// Frames are named from the --symbols map (lines of "address name" or nm output, hex
+// addresses, '#' comments) by the nearest symbol at or below the address, or printed as addresses.
+typedef struct CallNode {
+    uint32_t parent;
+    uint16_t function; // entry address of the frame
+    uint64_t samples;
+} CallNode;
+
+typedef struct CallStacks {
+    std::vector<CallNode> nodes;                       // node 0 is the entry frame
+    std::unordered_map<uint64_t, uint32_t> children;   // (parent << 16 | function) -> node
+    uint32_t current;
+    uint64_t period;
+    uint64_t countdown;                                // instructions until the next sample
+    std::vector<std::pair<uint16_t, std::string>> symbols; // sorted by address
+} CallStacks;
+
+// Loads "address name" lines from 'path' into 'calls'. Returns 0 if the file cannot be read.
+static int loadSymbolMap(CallStacks *calls, const char *path) {
+    FILE *fp = fopen(path, "r");
+    if (!fp) {
+        perror("Error opening symbol map");
+        return 0;
+    }
+    char line[256];
+    while (fgets(line, sizeof(line), fp)) {
+        char *p = line;
+        while (isspace((unsigned char)*p))
+            p++;
+        if (*p == '#' || *p == '\0')
+            continue;
+        char *end;
+        unsigned long addr = strtoul(p, &end, 16);
+        if (end == p || addr >= MEM_SIZE)
+            continue;
+        // The name is the last field before any comment, so nm output ("addr T name") works too
+        std::string name, field;
+        for (; *end && *end != '#'; end++) {
+            if (isspace((unsigned char)*end)) {
+                if (!field.empty())
+                    name.swap(field);
+                field.clear();
+            } else {
+                field += *end == ';' ? '_' : *end; // ';' separates frames in folded output
+            }
+        }
+        if (!field.empty())
+            name.swap(field);
+        if (!name.empty())
+            calls->symbols.push_back({(uint16_t)addr, name});
+    }
+    fclose(fp);
+    std::stable_sort(calls->symbols.begin(), calls->symbols.end(),
+                     [](const std::pair<uint16_t, std::string> &a, const std::pair<uint16_t, std::string> &b) {
+                         return a.first < b.first;
+                     });
+    return 1;
+}
+
+// Creates call stack tracking rooted at 'entryPc', sampling every 'period' instructions.
+// Returns NULL if the symbol map cannot be read.
+CallStacks *openCallStacks(uint16_t entryPc, uint64_t period, const char *symbolPath) {
+    CallStacks *calls = new CallStacks();
+    if (symbolPath && !loadSymbolMap(calls, symbolPath)) {
+        delete calls;
+        return NULL;
+    }
+    calls->nodes.push_back({0, entryPc, 0});
+    calls->current = 0;
+    calls->period = period;
+    calls->countdown = period;
+    return calls;
+}
+
+void closeCallStacks(CallStacks *calls) {
+    delete calls;
+}
+
+static inline void callSample(CallStacks *calls) {
+    if (--calls->countdown == 0) {
+        calls->countdown = calls->period;
+        calls->nodes[calls->current].samples++;
+    }
+}
+
+// Called after 'd' has executed and moved the machine to 'nextPc'.
+static inline void callTransfer(CallStacks *calls, const DecodedInst *d, uint16_t nextPc) {
+    if ((d->op == OP_JAL || d->op == OP_JALR) && d->rd == 1) {
+        uint64_t key = (uint64_t)calls->current << 16 | nextPc;
+        auto found = calls->children.find(key);
+        if (found != calls->children.end()) {
+            calls->current = found->second;
+        } else {
+            uint32_t node = (uint32_t)calls->nodes.size();
+            calls->nodes.push_back({calls->current, nextPc, 0});
+            calls->children.emplace(key, node);
+            calls->current = node;
+        }
+    } else if (d->op == OP_JR && d->rd == 1 && calls->current != 0) {
+        calls->current = calls->nodes[calls->current].parent;
+    }
+}
+
+static void appendFrameName(const CallStacks *calls, uint16_t addr, std::string *out) {
+    char buf[16];
+    auto sym = std::upper_bound(calls->symbols.begin(), calls->symbols.end(), addr,
+                                [](uint16_t a, const std::pair<uint16_t, std::string> &s) { return a < s.first; });
+    if (sym == calls->symbols.begin()) {
+        snprintf(buf, sizeof(buf), "0x%04X", addr);
+        *out += buf;
+        return;
+    }
+    --sym;
+    *out += sym->second;
+    if (sym->first != addr) {
+        snprintf(buf, sizeof(buf), "+0x%X", addr - sym->first);
+        *out += buf;
+    }
+}
+
+// Writes one folded line per sampled stack to 'out'.
+void writeFoldedStacks(const CallStacks *calls, FILE *out) {
+    std::vector<uint32_t> path;
+    std::string line;
+    for (uint32_t node = 0; node < calls->nodes.size(); node++) {
+        if (!calls->nodes[node].samples)
+            continue;
+        path.clear();
+        for (uint32_t n = node; n != 0; n = calls->nodes[n].parent)
+            path.push_back(n);
+        line.clear();
+        appendFrameName(calls, calls->nodes[0].function, &line);
+        for (size_t i = path.size(); i-- > 0;) {
+            line += ';';
+            appendFrameName(calls, calls->nodes[path[i]].function, &line);
+        }
+        fprintf(out, "%s %llu\n", line.c_str(), (unsigned long long)calls->nodes[node].samples);
+    }
+}
+
+// -----------------------
+// Coverage
+// -----------------------
+//
+// --coverage records which instruction addresses executed and which way each B-type branch
+// went. It keeps three bitmaps over the MEM_SIZE/2 instruction slots, 4 KB each: executed,
+// taken and not taken. Recording is a stepping-loop hook that sets one bit per instruction
+// and one more per branch, so a covered run costs little more than a plain
+// --engine=reference run.
+//
+// Coverage of separate runs combines by OR. The batch runner merges the bitmaps of its
+// workers, and --coverage-merge merges files written earlier. mergeCoverage ORs 32 or 16
+// bytes at a time when the compiler targets AVX2 or SSE2.
+//
+// A coverage file is a 16-byte header ("Z16C", version, slot count) followed by the three
+// bitmaps as little-endian 64-bit words. The report lists executed address ranges, the
+// rest of the image and branches seen going one way only. With a line map (lines of
+// "address file:line", hex addresses, '#' comments) coverage is also written as an lcov
+// tracefile for genhtml. Branches are found by decoding the image; without one (batch runs
+// over several images), only branches that executed are known.
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+#define COVERAGE_VERSION 1
+#define COVERAGE_WORDS (MEM_SIZE / 2 / 64)
+
+typedef struct Coverage {
+    uint64_t executed[COVERAGE_WORDS];
+    uint64_t taken[COVERAGE_WORDS];
+    uint64_t notTaken[COVERAGE_WORDS];
+} Coverage;
+
+typedef struct {
+    char magic[4];
+    uint32_t version;
+    uint32_t slots;
+    uint32_t reserved;
+} CoverageHeader;
+
+static inline int isBranch(uint8_t op) {
+    return op >= OP_BEQ && op <= OP_BGEU;
+}
+
+static inline int coverageBit(const uint64_t *bits, uint32_t slot) {
+    return (bits[slot >> 6] >> (slot & 63)) & 1;
+}
+
+// Called before 'd' at 'pc' executes.
+static inline void coverInstruction(Coverage *cov, const Z16Machine *m, const DecodedInst *d, uint16_t pc) {
+    uint32_t slot = pc >> 1;
+    uint64_t bit = 1ULL << (slot & 63);
+    cov->executed[slot >> 6] |= bit;
+    if (isBranch(d->op))
+        (branchTaken(m, d) ? cov->taken : cov->notTaken)[slot >> 6] |= bit;
+}
+
+// ORs the coverage in 'from' into 'into'.
+void mergeCoverage(Coverage *into, const Coverage *from) {
+    uint64_t *dst = (uint64_t *)into;
+    const uint64_t *src = (const uint64_t *)from;
+    const size_t words = sizeof(Coverage) / sizeof(uint64_t); // a multiple of four
+#if defined(__AVX2__)
+    for (size_t i = 0; i < words; i += 4) {
+        __m256i a = _mm256_loadu_si256((const __m256i *)(dst + i));
+        __m256i b = _mm256_loadu_si256((const __m256i *)(src + i));
+        _mm256_storeu_si256((__m256i *)(dst + i), _mm256_or_si256(a, b));
+    }
+#elif defined(__SSE2__)
+    for (size_t i = 0; i < words; i += 2) {
+        __m128i a = _mm_loadu_si128((const __m128i *)(dst + i));
+        __m128i b = _mm_loadu_si128((const __m128i *)(src + i));
+        _mm_storeu_si128((__m128i *)(dst + i), _mm_or_si128(a, b));
+    }
+#else
+    for (size_t i = 0; i < words; i++)
+        dst[i] |= src[i];
+#endif
+}
+
+// Writes 'cov' to 'path'. Returns 0 on success.
+int writeCoverage(const Coverage *cov, const char *path) {
+    FILE *fp = fopen(path, "wb");
+    if (!fp) {
+        perror("Error opening coverage file");
+        return 1;
+    }
+    CoverageHeader h = {};
+    memcpy(h.magic, "Z16C", 4);
+    h.version = COVERAGE_VERSION;
+    h.slots = MEM_SIZE / 2;
+    fwrite(&h, sizeof(h), 1, fp);
+    fwrite(cov, sizeof(Coverage), 1, fp);
+    int failed = ferror(fp); // a short fwrite sets the error flag
+    if (fclose(fp) != 0 || failed) {
+        perror("Error writing coverage file");
+        return 1;
+    }
+    return 0;
+}
+
+// ORs the coverage file at 'path' into 'cov'. Returns 0 (after reporting why) if the file
+// is unreadable or not a coverage file.
+int readCoverage(Coverage *cov, const char *path) {
+    FILE *fp = fopen(path, "rb");
+    if (!fp) {
+        perror("Error opening coverage file");
+        return 0;
+    }
+    CoverageHeader h;
+    Coverage *file = (Coverage *)malloc(sizeof(Coverage));
+    int ok = fread(&h, sizeof(h), 1, fp) == 1 && memcmp(h.magic, "Z16C", 4) == 0 &&
+             h.version == COVERAGE_VERSION && h.slots == MEM_SIZE / 2 && fread(file, sizeof(Coverage), 1, fp) == 1;
+    fclose(fp);
+    if (ok)
+        mergeCoverage(cov, file);
+    else
+        fprintf(stderr, "Error reading coverage file %s: not a Z16 coverage file\n", path);
+    free(file);
+    return ok;
+}
+
+// Whether the instruction slot 'slot' holds a B-type branch: decoded from 'code' (the
+// image, MEM_SIZE bytes) when given, otherwise known only if it executed.
+static int coverageBranch(const Coverage *cov, const unsigned char *code, uint32_t slot) {
+    if (code)
+        return isBranch(decodeInstruction(code[slot * 2] | (code[slot * 2 + 1] << 8)).op);
+    return coverageBit(cov->taken, slot) || coverageBit(cov->notTaken, slot);
+}
+
+// Writes the address-level report. 'code' is the image the runs started from (NULL: no
+// disassembly or unexecuted ranges) and 'codeSize' the bytes of it the binary supplied.
+void writeCoverageReport(const Coverage *cov, const unsigned char *code, size_t codeSize, FILE *out) {
+    uint32_t executed = 0, branches = 0, bothWays = 0;
+    for (uint32_t slot = 0; slot < MEM_SIZE / 2; slot++) {
+        if (!coverageBit(cov->executed, slot))
+            continue;
+        executed++;
+        int taken = coverageBit(cov->taken, slot), notTaken = coverageBit(cov->notTaken, slot);
+        branches += taken | notTaken;
+        bothWays += taken & notTaken;
+    }
+    uint32_t slots = (uint32_t)((codeSize + 1) / 2);
+    fprintf(out, "Coverage: %u instructions executed", executed);
+    if (code && slots)
+        fprintf(out, " (of %u slots in the image, %.1f%%)", slots, 100.0 * executed / slots);
+    fprintf(out, "\nBranches: %u executed, %u both ways, %u one way only\n", branches, bothWays,
+            branches - bothWays);
+
+    fprintf(out, "\nExecuted ranges:\n");
+    for (uint32_t slot = 0; slot < MEM_SIZE / 2;) {
+        if (!coverageBit(cov->executed, slot)) {
+            slot++;
+            continue;
+        }
+        uint32_t first = slot;
+        while (slot < MEM_SIZE / 2 && coverageBit(cov->executed, slot))
+            slot++;
+        fprintf(out, "  0x%04X-0x%04X %6u instruction%s\n", first * 2, slot * 2 - 2, slot - first,
+                slot - first == 1 ? "" : "s");
+    }
+    if (code) {
+        fprintf(out, "\nNot executed (in the image):\n");
+        for (uint32_t slot = 0; slot < slots;) {
+            if (coverageBit(cov->executed, slot)) {
+                slot++;
+                continue;
+            }
+            uint32_t first = slot;
+            while (slot < slots && !coverageBit(cov->executed, slot))
+                slot++;
+            fprintf(out, "  0x%04X-0x%04X %6u slot%s\n", first * 2, slot * 2 - 2, slot - first,
+                    slot - first == 1 ? "" : "s");
+        }
+    }
+
+    fprintf(out, "\nBranches taken one way only:\n");
+    for (uint32_t slot = 0; slot < MEM_SIZE / 2; slot++) {
+        int taken = coverageBit(cov->taken, slot), notTaken = coverageBit(cov->notTaken, slot);
+        if (taken == notTaken)
+            continue;
+        char text[64] = "";
+        if (code)
+            disassemble(code[slot * 2] | (code[slot * 2 + 1] << 8), (uint16_t)(slot * 2), text, sizeof(text));
+        fprintf(out, "  0x%04X  %-14s %s\n", slot * 2, taken ? "taken only" : "not taken only", text);
+    }
+}
+
+// Source lines of guest addresses, from a --line-map file.
+typedef struct LineMap {
+    std::vector<std::string> files;
+    struct Entry { uint16_t pc; uint32_t file; uint32_t line; };
+    std::vector<Entry> entries;
+} LineMap;
+
+// Loads "address file:line" lines from 'path'. Returns NULL if the file cannot be read.
+LineMap *loadLineMap(const char *path) {
+    FILE *fp = fopen(path, "r");
+    if (!fp) {
+        perror("Error opening line map");
+        return NULL;
+    }
+    LineMap *map = new LineMap;
+    std::unordered_map<std::string, uint32_t> fileIndex;
+    char line[1024];
+    while (fgets(line, sizeof(line), fp)) {
+        char *p = line;
+        while (isspace((unsigned char)*p))
+            p++;
+        if (*p == '#' || *p == '\0')
+            continue;
+        char *end;
+        unsigned long addr = strtoul(p, &end, 16);
+        if (end == p || addr >= MEM_SIZE)
+            continue;
+        while (isspace((unsigned char)*end))
+            end++;
+        size_t len = strcspn(end, "#\r\n");
+        while (len && isspace((unsigned char)end[len - 1]))
+            len--;
+        std::string where(end, len);
+        size_t colon = where.rfind(':');
+        if (colon == std::string::npos || colon == 0)
+            continue;
+        unsigned long lineNo = strtoul(where.c_str() + colon + 1, NULL, 10);
+        if (lineNo == 0)
+            continue;
+        where.resize(colon);
+        uint32_t file = fileIndex.emplace(where, (uint32_t)map->files.size()).first->second;
+        if (file == map->files.size())
+            map->files.push_back(where);
+        map->entries.push_back({(uint16_t)(addr & ~1UL), file, (uint32_t)lineNo});
+    }
+    fclose(fp);
+    std::sort(map->entries.begin(), map->entries.end(), [](const LineMap::Entry &a, const LineMap::Entry &b) {
+        return a.file != b.file ? a.file < b.file : a.line != b.line ? a.line < b.line : a.pc < b.pc;
+    });
+    return map;
+}
+
+// Writes 'cov' as an lcov tracefile: per source line whether any of its instructions
+// executed, and two branch entries (taken, not taken) per B-type branch on it.
+void writeLcov(const Coverage *cov, const unsigned char *code, const LineMap *map, FILE *out) {
+    fprintf(out, "TN:\n");
+    size_t i = 0;
+    while (i < map->entries.size()) {
+        uint32_t file = map->entries[i].file;
+        uint32_t linesFound = 0, linesHit = 0, branchesFound = 0, branchesHit = 0;
+        fprintf(out, "SF:%s\n", map->files[file].c_str());
+        std::string branchLines;
+        while (i < map->entries.size() && map->entries[i].file == file) {
+            uint32_t lineNo = map->entries[i].line;
+            int hit = 0, branch = 0;
+            char buf[96];
+            for (; i < map->entries.size() && map->entries[i].file == file && map->entries[i].line == lineNo; i++) {
+                uint32_t slot = map->entries[i].pc >> 1;
+                int executed = coverageBit(cov->executed, slot);
+                hit |= executed;
+                if (!coverageBranch(cov, code, slot))
+                    continue;
+                const uint64_t *ways[2] = {cov->taken, cov->notTaken};
+                for (int w = 0; w < 2; w++) {
+                    int taken = coverageBit(ways[w], slot);
+                    if (executed)
+                        snprintf(buf, sizeof(buf), "BRDA:%u,%d,%d,%d\n", lineNo, branch, w, taken);
+                    else
+                        snprintf(buf, sizeof(buf), "BRDA:%u,%d,%d,-\n", lineNo, branch, w);
+                    branchLines += buf;
+                    branchesFound++;
+                    branchesHit += taken;
+                }
+                branch++;
+            }
+            fprintf(out, "DA:%u,%d\n", lineNo, hit);
+            linesFound++;
+            linesHit += hit;
+        }
+        fputs(branchLines.c_str(), out);
+        fprintf(out, "BRF:%u\nBRH:%u\nLF:%u\nLH:%u\nend_of_record\n", branchesFound, branchesHit, linesFound,
+                linesHit);
+    }
+}
+
+// Writes the coverage outputs that were asked for (NULL paths are skipped): the bitmap
+// file, the report ("" for stderr) and, with a line map, the lcov tracefile. Returns 0
+// on success.
+int writeCoverageOutputs(const Coverage *cov, const unsigned char *code, size_t codeSize, const char *bitmapPath,
+                         const char *reportPath, const char *lineMapPath, const char *lcovPath) {
+    int status = 0;
+    if (bitmapPath)
+        status |= writeCoverage(cov, bitmapPath);
+    if (reportPath) {
+        FILE *out = *reportPath ? fopen(reportPath, "w") : stderr;
+        if (!out) {
+            perror("Error opening coverage report");
+            status = 1;
+        } else {
+            fflush(stdout);
+            writeCoverageReport(cov, code, codeSize, out);
+            if (out != stderr)
+                fclose(out);
+        }
+    }
+    if (lcovPath) {
+        LineMap *map = loadLineMap(lineMapPath);
+        FILE *out = map ? fopen(lcovPath, "w") : NULL;
+        if (map && !out)
+            perror("Error opening lcov file");
+        if (out) {
+            writeLcov(cov, code, map, out);
+            fclose(out);
+        } else {
+            status = 1;
+        }
+        delete map;
+    }
+    return status;
+}
+
+// Merges the coverage files 'paths' and writes the outputs for them, disassembling from
+// 'image'. Returns 0 when every file was read and every output written.
+int runCoverageMerge(const char *image, char **paths, int count, const char *bitmapPath, const char *reportPath,
+                     const char *lineMapPath, const char *lcovPath) {
+    Z16Image *img = openImage(image);
+    if (!img)
+        return 1;
+    Coverage *cov = (Coverage *)calloc(1, sizeof(Coverage));
+    int status = 0;
+    for (int i = 0; i < count; i++)
+        status |= !readCoverage(cov, paths[i]);
+    status |= writeCoverageOutputs(cov, img->data, img->size, bitmapPath, reportPath, lineMapPath, lcovPath);
+    free(cov);
+    closeImage(img);
+    return status;
+}
+
+// -----------------------
+// Observers
+// -----------------------
+//
+// Architectural models (caches, branch predictors, timing) attach to a machine as a chain
+// of observers. The stepping loop hands each retired instruction to every observer in
+// order; the fast engines never look at the chain, and a machine without observers runs a
+// stepping loop compiled without the call. A model embeds Observer as its first member.
+// Models earlier in the chain record what happened to the instruction (cache misses,
+// mispredictions) in the Retired record for the ones after them, such as the timing model.
+enum { MISS_NONE, MISS_L1, MISS_MEMORY }; // deepest level an access missed in
+typedef struct Retired {
+    uint16_t pc;
+    uint16_t nextPc;
+    const DecodedInst *d;
+    uint16_t addr;        // effective address of a load or store
+    uint8_t fetchMiss;    // MISS_L1: missed the I-cache, hit the L2; MISS_MEMORY: missed both
+    uint8_t dataMiss;     // the same for the D-cache
+    uint8_t mispredicted; // 1 if the branch predictor got the next PC wrong
+} Retired;
+
+typedef struct Observer {
+    void (*retire)(struct Observer *obs, Retired *r);
+    void (*report)(struct Observer *obs, const Z16Machine *m, FILE *out);
+    void (*destroy)(struct Observer *obs);
+    struct Observer *next;
+} Observer;
+
+// Returns the index of 'name' in 'names', or -1.
+static int lookupName(const char *name, const char *const *names, int count) {
+    for (int i = 0; i < count; i++)
+        if (strcmp(name, names[i]) == 0)
+            return i;
+    return -1;
+}
+
+// Appends 'obs' to the end of the chain, so observers see instructions in attach order.
+void attachObserver(Z16Machine *m, Observer *obs) {
+    Observer **link = &m->observers;
+    while (*link)
+        link = &(*link)->next;
+    obs->next = NULL;
+    *link = obs;
+}
+
+// Writes every observer's report to 'out' and destroys the chain.
+void closeObservers(Z16Machine *m, FILE *out) {
+    while (Observer *obs = m->observers) {
+        m->observers = obs->next;
+        obs->report(obs, m, out);
+        obs->destroy(obs);
+    }
+}
+
+static inline int isLoad(uint8_t op) {
+    return op == OP_LB || op == OP_LW || op == OP_LBU;
+}
+
+static inline int isStore(uint8_t op) {
+    return op == OP_SB || op == OP_SW;
+}
+
+// Effective address of the load or store 'd', from the registers before it executes.
+static inline uint16_t memoryAddress(const Z16Machine *m, const DecodedInst *d) {
+    return (uint16_t)((isStore(d->op) ? m->regs[d->rd] : m->regs[d->rs2]) + d->imm);
+}
+
+// -----------------------
+// Cache Model
+// -----------------------
+//
+// --icache, --dcache and --l2cache=SIZE:LINE:WAYS[:POLICY] model set-associative caches on
+// the fetch and load/store paths; misses in either first-level cache go to the unified L2
+// when there is one. Sizes are powers of two in bytes (a 'k' suffix multiplies by 1024),
+// and the policy is lru (default), plru (tree pseudo-LRU) or random. Caches allocate on
+// every miss, stores included, and only hits and misses are counted: the model decides
+// what would have been resident, not how long it would have taken. Hits and misses are
+// also kept per instruction address for the report.
+enum { REPLACE_LRU, REPLACE_PLRU, REPLACE_RANDOM };
+static const char *const replaceNames[] = {"lru", "plru", "random"};
+#define CACHE_MAX_WAYS 64
+#define CACHE_HOT_SPOTS 10
+
+typedef struct Cache {
+    char name[8];
+    uint32_t sets;
+    uint32_t ways;
+    uint32_t lineShift;
+    int policy;
+    uint32_t *tags;    // sets * ways line numbers plus one; 0 marks an empty way
+    uint64_t *stamps;  // LRU: last use of each way
+    uint64_t *trees;   // PLRU: one tree of ways-1 direction bits per set, node i at bit i
+    uint64_t clock;
+    uint64_t random;
+    uint64_t hits;
+    uint64_t misses;
+} Cache;
+
+static int isPowerOfTwo(unsigned long v) {
+    return v && !(v & (v - 1));
+}
+
+static unsigned long parseSize(const char *s, char **end) {
+    unsigned long v = strtoul(s, end, 0);
+    if (**end == 'k' || **end == 'K') {
+        v *= 1024;
+        (*end)++;
+    } else if (**end == 'm' || **end == 'M') {
+        v *= 1024 * 1024;
+        (*end)++;
+    }
+    return v;
+}
+
+// Parses "SIZE:LINE:WAYS[:POLICY]" into a new cache. Returns NULL if the geometry is invalid.
+Cache *createCache(const char *name, const char *spec) {
+    char *end;
+    unsigned long size = parseSize(spec, &end);
+    unsigned long line = *end == ':' ? parseSize(end + 1, &end) : 0;
+    unsigned long ways = *end == ':' ? strtoul(end + 1, &end, 0) : 0;
+    int policy = REPLACE_LRU;
+    if (*end == ':') {
+        policy = lookupName(end + 1, replaceNames, 3);
+        end += strlen(end);
+    }
+    if (*end || policy < 0 || !isPowerOfTwo(size) || !isPowerOfTwo(line) || line < 2 ||
+        !isPowerOfTwo(ways) || ways > CACHE_MAX_WAYS || size > MEM_SIZE || size < line * ways) {
+        fprintf(stderr, "Invalid %s geometry '%s' (SIZE:LINE:WAYS[:lru|plru|random], powers of two)\n",
+                name, spec);
+        return NULL;
+    }
+
+    Cache *c = (Cache *)calloc(1, sizeof(Cache));
+    snprintf(c->name, sizeof(c->name), "%s", name);
+    c->ways = (uint32_t)ways;
+    c->sets = (uint32_t)(size / line / ways);
+    c->lineShift = 0;
+    while ((1ul << c->lineShift) < line)
+        c->lineShift++;
+    c->policy = policy;
+    c->tags = (uint32_t *)calloc(c->sets * c->ways, sizeof(uint32_t));
+    c->stamps = (uint64_t *)calloc(c->sets * c->ways, sizeof(uint64_t));
+    c->trees = (uint64_t *)calloc(c->sets, sizeof(uint64_t));
+    c->random = 0x9E3779B97F4A7C15ull;
+    return c;
+}
+
+void destroyCache(Cache *c) {
+    if (!c)
+        return;
+    free(c->tags);
+    free(c->stamps);
+    free(c->trees);
+    free(c);
+}
+
+// Marks 'way' of 'set' as the most recently used.
+static inline void cacheTouch(Cache *c, uint32_t set, uint32_t way) {
+    if (c->policy == REPLACE_LRU) {
+        c->stamps[set * c->ways + way] = ++c->clock;
+    } else if (c->policy == REPLACE_PLRU) { // point every node on the path away from 'way'
+        uint64_t tree = c->trees[set];
+        uint32_t node = 1;
+        for (uint32_t half = c->ways >> 1; half; half >>= 1) {
+            uint32_t right = (way & half) != 0;
+            tree = right ? tree & ~(1ull << node) : tree | (1ull << node);
+            node = node * 2 + right;
+        }
+        c->trees[set] = tree;
+    }
+}
+
+static inline uint32_t cacheVictim(Cache *c, uint32_t set) {
+    const uint32_t *tags = &c->tags[set * c->ways];
+    for (uint32_t way = 0; way < c->ways; way++)
+        if (!tags[way])
+            return way;
+    if (c->policy == REPLACE_LRU) {
+        const uint64_t *stamps = &c->stamps[set * c->ways];
+        uint32_t victim = 0;
+        for (uint32_t way = 1; way < c->ways; way++)
+            if (stamps[way] < stamps[victim])
+                victim = way;
+        return victim;
+    }
+    if (c->policy == REPLACE_PLRU) { // follow the direction bits to the least recent leaf
+        uint64_t tree = c->trees[set];
+        uint32_t node = 1, way = 0;
+        for (uint32_t half = c->ways >> 1; half; half >>= 1) {
+            uint32_t right = (tree >> node) & 1;
+            way |= right ? half : 0;
+            node = node * 2 + right;
+        }
+        return way;
+    }
+    c->random ^= c->random << 13; // xorshift64
+    c->random ^= c->random >> 7;
+    c->random ^= c->random << 17;
+    return (uint32_t)(c->random % c->ways);
+}
+
+// Looks up the line holding 'addr', filling it on a miss. Returns 1 on a hit.
+static inline int cacheAccess(Cache *c, uint16_t addr) {
+    uint32_t line = addr >> c->lineShift;
+    uint32_t set = line & (c->sets - 1);
+    uint32_t *tags = &c->tags[set * c->ways];
+    for (uint32_t way = 0; way < c->ways; way++) {
+        if (tags[way] == line + 1) {
+            c->hits++;
+            cacheTouch(c, set, way);
+            return 1;
+        }
+    }
+    c->misses++;
+    uint32_t way = cacheVictim(c, set);
+    tags[way] = line + 1;
+    cacheTouch(c, set, way);
+    return 0;
+}
+
+typedef struct CacheModel {
+    Observer base;
+    Cache *icache;
+    Cache *dcache;
+    Cache *l2;
+    uint64_t fetches[MEM_SIZE / 2]; // by instruction address
+    uint64_t fetchMisses[MEM_SIZE / 2];
+    uint64_t dataAccesses[MEM_SIZE / 2];
+    uint64_t dataMisses[MEM_SIZE / 2];
+} CacheModel;
+
+// Accesses 'size' bytes at 'addr' through 'l1' and, on a first-level miss, the L2. Returns
+// the deepest level missed (MISS_*); without an L2 a first-level miss goes to memory.
+static inline int cacheModelAccess(CacheModel *cm, Cache *l1, uint16_t addr, int size) {
+    int missed = MISS_NONE;
+    uint16_t last = (uint16_t)(addr + size - 1);
+    for (int i = 0; i < 1 + ((addr >> l1->lineShift) != (last >> l1->lineShift)); i++) {
+        uint16_t a = i ? last : addr;
+        if (!cacheAccess(l1, a)) {
+            int level = cm->l2 && cacheAccess(cm->l2, a) ? MISS_L1 : MISS_MEMORY;
+            missed = level > missed ? level : missed;
+        }
+    }
+    return missed;
+}
+
+static void cacheModelRetire(Observer *obs, Retired *r) {
+    CacheModel *cm = (CacheModel *)obs;
+    uint32_t slot = r->pc >> 1;
+    if (cm->icache) {
+        cm->fetches[slot]++;
+        if ((r->fetchMiss = (uint8_t)cacheModelAccess(cm, cm->icache, r->pc, 2)))
+            cm->fetchMisses[slot]++;
+    }
+    if (cm->dcache && (isLoad(r->d->op) || isStore(r->d->op))) {
+        int size = r->d->op == OP_LW || r->d->op == OP_SW ? 2 : 1;
+        cm->dataAccesses[slot]++;
+        if ((r->dataMiss = (uint8_t)cacheModelAccess(cm, cm->dcache, r->addr, size)))
+            cm->dataMisses[slot]++;
+    }
+}
+
+static void writeCacheSummary(const Cache *c, FILE *out) {
+    uint64_t accesses = c->hits + c->misses;
+    fprintf(out, "  %-6s %6u B %4u B line %3u-way %-6s %14llu accesses %12llu misses %7.2f%%\n", c->name,
+            (c->sets * c->ways) << c->lineShift, 1u << c->lineShift, c->ways, replaceNames[c->policy],
+            (unsigned long long)accesses, (unsigned long long)c->misses,
+            accesses ? 100.0 * c->misses / accesses : 0.0);
+}
+
+// Lists the CACHE_HOT_SPOTS addresses with the most misses in 'misses' out of 'accesses',
+// both indexed by pc/2, with the given column labels.
+static void writeMissSpots(const Z16Machine *m, const char *title, const uint64_t *misses,
+                           const uint64_t *accesses, const char *hitLabel, const char *missLabel,
+                           FILE *out) {
+    std::vector<uint32_t> spots;
+    for (uint32_t slot = 0; slot < MEM_SIZE / 2; slot++)
+        if (misses[slot])
+            spots.push_back(slot);
+    size_t shown = spots.size() < CACHE_HOT_SPOTS ? spots.size() : CACHE_HOT_SPOTS;
+    std::partial_sort(spots.begin(), spots.begin() + shown, spots.end(), [&](uint32_t a, uint32_t b) {
+        return misses[a] > misses[b] || (misses[a] == misses[b] && a < b);
+    });
+    fprintf(out, "%s (%zu of %zu addresses):\n", title, shown, spots.size());
+    fprintf(out, "  %-6s %14s %14s %8s  %s\n", "pc", hitLabel, missLabel, "rate", "instruction");
+    char text[64];
+    for (size_t i = 0; i < shown; i++) {
+        uint16_t pc = (uint16_t)(spots[i] << 1);
+        disassemble(loadWord(m, pc), pc, text, sizeof(text));
+        fprintf(out, "  0x%04X %14llu %14llu %7.2f%%  %s\n", pc,
+                (unsigned long long)(accesses[spots[i]] - misses[spots[i]]), (unsigned long long)misses[spots[i]],
+                100.0 * misses[spots[i]] / accesses[spots[i]], text);
+    }
+}
+
+static void cacheModelReport(Observer *obs, const Z16Machine *m, FILE *out) {
+    CacheModel *cm = (CacheModel *)obs;
+    fprintf(out, "Caches:\n");
+    for (const Cache *c : {cm->icache, cm->dcache, cm->l2})
+        if (c)
+            writeCacheSummary(c, out);
+    if (cm->icache)
+        writeMissSpots(m, "I-cache misses", cm->fetchMisses, cm->fetches, "hits", "misses", out);
+    if (cm->dcache)
+        writeMissSpots(m, "D-cache misses", cm->dataMisses, cm->dataAccesses, "hits", "misses", out);
+}
+
+static void cacheModelDestroy(Observer *obs) {
+    CacheModel *cm = (CacheModel *)obs;
+    destroyCache(cm->icache);
+    destroyCache(cm->dcache);
+    destroyCache(cm->l2);
+    free(cm);
+}
+
+// Builds the cache hierarchy from the given specs (NULL: no such cache). Returns NULL if a
+// spec is invalid.
+Observer *createCacheModel(const char *icache, const char *dcache, const char *l2) {
+    CacheModel *cm = (CacheModel *)calloc(1, sizeof(CacheModel));
+    cm->base.retire = cacheModelRetire;
+    cm->base.report = cacheModelReport;
+    cm->base.destroy = cacheModelDestroy;
+    if ((icache && !(cm->icache = createCache("L1I", icache))) ||
+        (dcache && !(cm->dcache = createCache("L1D", dcache))) || (l2 && !(cm->l2 = createCache("L2", l2)))) {
+        cacheModelDestroy(&cm->base);
+        return NULL;
+    }
+    return &cm->base;
+}
+
+// -----------------------
+// Branch Predictor Model
+// -----------------------
+//
+// --bpred=KIND[:ENTRIES[:HISTORY]] predicts B-type branch directions with one of:
+//   static   backward taken, forward not taken
+//   bimodal  a table of 2-bit saturating counters indexed by pc/2
+//   gshare   the same counters indexed by pc/2 XOR the global history of HISTORY outcomes
+// ENTRIES defaults to 1024 counters and HISTORY to 10 bits. jr ra is predicted by a return
+// address stack that jal/jalr writing ra push (--ras=DEPTH, default 8, oldest entry lost on
+// overflow), and other jr/jalr by a direct-mapped, tagged branch target buffer
+// (--btb=ENTRIES, default 64). j and jal targets come from the instruction and are never
+// mispredicted. Predictions and mispredictions are kept per branch address.
+enum { BPRED_STATIC, BPRED_BIMODAL, BPRED_GSHARE };
+static const char *const bpredNames[] = {"static", "bimodal", "gshare"};
+enum { BRANCH_CONDITIONAL, BRANCH_RETURN, BRANCH_INDIRECT, BRANCH_CLASSES };
+static const char *const branchClassNames[BRANCH_CLASSES] = {"conditional", "return", "indirect"};
+#define BPRED_HOT_SPOTS 10
+
+typedef struct BranchModel {
+    Observer base;
+    int kind;
+    uint32_t counterMask;
+    uint32_t historyMask;
+    uint32_t history;
+    uint8_t *counters;        // 2-bit counters, >= 2 predicts taken
+    uint32_t btbEntries;
+    uint16_t *btbTags;        // branch address plus one; 0 marks an empty entry
+    uint16_t *btbTargets;
+    uint32_t rasDepth;
+    uint32_t rasTop;          // total pushes minus pops; entries wrap modulo rasDepth
+    uint16_t *ras;
+    uint64_t predictions[BRANCH_CLASSES];
+    uint64_t mispredictions[BRANCH_CLASSES];
+    uint64_t executions[MEM_SIZE / 2]; // by branch address
+    uint64_t misses[MEM_SIZE / 2];
+} BranchModel;
+
+// Returns 1 if the conditional branch at 'pc' was predicted correctly, then trains on it.
+static inline int predictConditional(BranchModel *bp, const DecodedInst *d, uint16_t pc, int taken) {
+    if (bp->kind == BPRED_STATIC)
+        return (d->imm < 0) == taken;
+    uint32_t index = pc >> 1;
+    if (bp->kind == BPRED_GSHARE) {
+        index ^= bp->history;
+        bp->history = ((bp->history << 1) | taken) & bp->historyMask;
+    }
+    uint8_t *counter = &bp->counters[index & bp->counterMask];
+    int correct = (*counter >= 2) == taken;
+    if (taken && *counter < 3)
+        (*counter)++;
+    else if (!taken && *counter > 0)
+        (*counter)--;
+    return correct;
+}
+
+static void branchModelRetire(Observer *obs, Retired *r) {
+    BranchModel *bp = (BranchModel *)obs;
+    const DecodedInst *d = r->d;
+    int cls, correct;
+    if (d->op >= OP_BEQ && d->op <= OP_BGEU) {
+        cls = BRANCH_CONDITIONAL;
+        correct = predictConditional(bp, d, r->pc, r->nextPc != (uint16_t)(r->pc + 2));
+    } else if (d->op == OP_JR && d->rd == 1 && bp->rasDepth) {
+        cls = BRANCH_RETURN;
+        correct = bp->rasTop && bp->ras[--bp->rasTop % bp->rasDepth] == r->nextPc;
+    } else if (d->op == OP_JR || d->op == OP_JALR) {
+        cls = BRANCH_INDIRECT;
+        correct = 0;
+        if (bp->btbEntries) {
+            uint32_t entry = (r->pc >> 1) & (bp->btbEntries - 1);
+            correct = bp->btbTags[entry] == r->pc + 1 && bp->btbTargets[entry] == r->nextPc;
+            bp->btbTags[entry] = r->pc + 1;
+            bp->btbTargets[entry] = r->nextPc;
+        }
+    } else if (d->op != OP_JAL) {
+        return;
+    } else {
+        cls = -1; // direct call: only feeds the return stack
+        correct = 1;
+    }
+    if ((d->op == OP_JAL || d->op == OP_JALR) && d->rd == 1 && bp->rasDepth)
+        bp->ras[bp->rasTop++ % bp->rasDepth] = (uint16_t)(r->pc + 2);
+    if (cls < 0)
+        return;
+
+    bp->predictions[cls]++;
+    bp->executions[r->pc >> 1]++;
+    if (!correct) {
+        r->mispredicted = 1;
+        bp->mispredictions[cls]++;
+        bp->misses[r->pc >> 1]++;
+    }
+}
+
+static void branchModelReport(Observer *obs, const Z16Machine *m, FILE *out) {
+    BranchModel *bp = (BranchModel *)obs;
+    fprintf(out, "Branch prediction (%s", bpredNames[bp->kind]);
+    if (bp->kind != BPRED_STATIC)
+        fprintf(out, ", %u counters", bp->counterMask + 1);
+    if (bp->kind == BPRED_GSHARE) {
+        int bits = 0;
+        while (bp->historyMask >> bits)
+            bits++;
+        fprintf(out, ", %d history bits", bits);
+    }
+    fprintf(out, ", %u-entry BTB, %u-entry RAS):\n", bp->btbEntries, bp->rasDepth);
+    uint64_t predictions = 0, mispredictions = 0;
+    for (int cls = 0; cls < BRANCH_CLASSES; cls++) {
+        predictions += bp->predictions[cls];
+        mispredictions += bp->mispredictions[cls];
+        fprintf(out, "  %-11s %14llu predicted %12llu mispredicted %7.2f%%\n", branchClassNames[cls],
+                (unsigned long long)bp->predictions[cls], (unsigned long long)bp->mispredictions[cls],
+                bp->predictions[cls] ? 100.0 * bp->mispredictions[cls] / bp->predictions[cls] : 0.0);
+    }
+    fprintf(out, "  %-11s %14llu predicted %12llu mispredicted %7.2f%%\n", "total",
+            (unsigned long long)predictions, (unsigned long long)mispredictions,
+            predictions ? 100.0 * mispredictions / predictions : 0.0);
+    writeMissSpots(m, "Mispredicted branches", bp->misses, bp->executions, "correct", "wrong", out);
+}
+
+static void branchModelDestroy(Observer *obs) {
+    BranchModel *bp = (BranchModel *)obs;
+    free(bp->counters);
+    free(bp->btbTags);
+    free(bp->btbTargets);
+    free(bp->ras);
+    free(bp);
+}
+
+// Parses "KIND[:ENTRIES[:HISTORY]]" and builds the predictor with a 'btbEntries' BTB and a
+// 'rasDepth' return stack (either may be 0). Returns NULL if the spec is invalid.
+Observer *createBranchModel(const char *spec, unsigned long btbEntries, unsigned long rasDepth) {
+    int kind;
+    size_t len = strcspn(spec, ":");
+    for (kind = 0; kind < 3; kind++)
+        if (strlen(bpredNames[kind]) == len && strncmp(spec, bpredNames[kind], len) == 0)
+            break;
+    char *end = (char *)spec + len;
+    unsigned long entries = 1024, historyBits = 10;
+    if (*end == ':')
+        entries = parseSize(end + 1, &end);
+    if (*end == ':')
+        historyBits = strtoul(end + 1, &end, 0);
+    if (kind == 3 || *end || !isPowerOfTwo(entries) || entries > MEM_SIZE || historyBits > 16 ||
+        (btbEntries && !isPowerOfTwo(btbEntries)) || btbEntries > MEM_SIZE / 2 || rasDepth > 1024) {
+        fprintf(stderr, "Invalid branch predictor '%s' (static|bimodal|gshare[:ENTRIES[:HISTORY]], "
+                        "--btb a power of two)\n", spec);
+        return NULL;
+    }
+
+    BranchModel *bp = (BranchModel *)calloc(1, sizeof(BranchModel));
+    bp->base.retire = branchModelRetire;
+    bp->base.report = branchModelReport;
+    bp->base.destroy = branchModelDestroy;
+    bp->kind = kind;
+    bp->counterMask = (uint32_t)entries - 1;
+    bp->historyMask = (1u << historyBits) - 1;
+    bp->counters = (uint8_t *)malloc(entries);
+    memset(bp->counters, 1, entries); // weakly not taken
+    bp->btbEntries = (uint32_t)btbEntries;
+    bp->btbTags = (uint16_t *)calloc(btbEntries ? btbEntries : 1, sizeof(uint16_t));
+    bp->btbTargets = (uint16_t *)calloc(btbEntries ? btbEntries : 1, sizeof(uint16_t));
+    bp->rasDepth = (uint32_t)rasDepth;
+    bp->ras = (uint16_t *)calloc(rasDepth ? rasDepth : 1, sizeof(uint16_t));
+    return &bp->base;
+}
+
+// -----------------------
+// Timing Model
+// -----------------------
+//
+// --timing[=PATH] estimates cycles for a simple in-order pipeline. Every instruction costs
+// the base latency of its class. Penalties are added for cache misses and branch
+// mispredictions reported by the models before it in the observer chain, and for a
+// load-use stall when an instruction reads the register the previous load wrote. The
+// config file holds "name cycles" lines ('#' comments); names are the classes alu, shift,
+// load, store, branch, jump and ecall, and the penalties mispredict, l2-hit (an L1 miss
+// served by the L2), memory (a miss served by memory) and load-use. Unlisted entries keep
+// their defaults. Class latencies are stamped into DecodedInst::cycles when the stepping
+// loop fills the decode cache, so the per-instruction cost is one byte load plus penalties.
+enum { CLASS_ALU, CLASS_SHIFT, CLASS_LOAD, CLASS_STORE, CLASS_BRANCH, CLASS_JUMP, CLASS_ECALL, CLASS_COUNT };
+enum { PENALTY_MISPREDICT, PENALTY_L2_HIT, PENALTY_MEMORY, PENALTY_LOAD_USE, PENALTY_COUNT };
+static const char *const classNames[CLASS_COUNT] = {"alu", "shift", "load", "store", "branch", "jump", "ecall"};
+static const char *const penaltyNames[PENALTY_COUNT] = {"mispredict", "l2-hit", "memory", "load-use"};
+static const uint8_t defaultClassCycles[CLASS_COUNT] = {1, 1, 2, 1, 1, 2, 1};
+static const uint32_t defaultPenaltyCycles[PENALTY_COUNT] = {3, 8, 40, 1};
+
+enum { STALL_FETCH, STALL_DATA, STALL_MISPREDICT, STALL_LOAD_USE, STALL_KINDS };
+static const char *const stallNames[STALL_KINDS] = {"i-cache", "d-cache", "mispredict", "load-use"};
+
+static int opClass(uint8_t op) {
+    if (op == OP_SLL || op == OP_SRL || op == OP_SRA || op == OP_SLLI || op == OP_SRLI || op == OP_SRAI)
+        return CLASS_SHIFT;
+    if (isLoad(op))
+        return CLASS_LOAD;
+    if (isStore(op))
+        return CLASS_STORE;
+    if (op >= OP_BEQ && op <= OP_BGEU)
+        return CLASS_BRANCH;
+    if (op == OP_J || op == OP_JAL || op == OP_JR || op == OP_JALR)
+        return CLASS_JUMP;
+    if (op == OP_ECALL)
+        return CLASS_ECALL;
+    return CLASS_ALU;
+}
+
+// Bit mask of the registers 'd' reads.
+static inline unsigned sourceRegs(const DecodedInst *d) {
+    unsigned rd = 1u << d->rd, rs2 = 1u << d->rs2;
+    switch (d->op) {
+        case OP_MV: case OP_JALR: case OP_LB: case OP_LW: case OP_LBU:
+            return rs2;
+        case OP_JR: case OP_BZ: case OP_BNZ:
+            return rd;
+        case OP_LI: case OP_J: case OP_JAL: case OP_LUI: case OP_AUIPC: case OP_ILLEGAL:
+            return 0;
+        case OP_ECALL:
+            return 1u << 6; // a0
+        default:
+            return (d->op >= OP_ADDI && d->op <= OP_XORI) ? rd : rd | rs2;
+    }
+}
+
+typedef struct TimingModel {
+    Observer base;
+    uint8_t latencies[OP_COUNT];
+    uint32_t penalties[PENALTY_COUNT];
+    unsigned loadedRegs;      // register written by the previous instruction if it was a load
+    uint64_t instructions;
+    uint64_t baseCycles;
+    uint64_t stalls[STALL_KINDS];
+} TimingModel;
+
+static void timingModelRetire(Observer *obs, Retired *r) {
+    TimingModel *tm = (TimingModel *)obs;
+    const DecodedInst *d = r->d;
+    tm->instructions++;
+    tm->baseCycles += d->cycles ? d->cycles : tm->latencies[d->op];
+    if (r->fetchMiss)
+        tm->stalls[STALL_FETCH] += tm->penalties[r->fetchMiss == MISS_L1 ? PENALTY_L2_HIT : PENALTY_MEMORY];
+    if (r->dataMiss)
+        tm->stalls[STALL_DATA] += tm->penalties[r->dataMiss == MISS_L1 ? PENALTY_L2_HIT : PENALTY_MEMORY];
+    if (r->mispredicted)
+        tm->stalls[STALL_MISPREDICT] += tm->penalties[PENALTY_MISPREDICT];
+    if (sourceRegs(d) & tm->loadedRegs)
+        tm->stalls[STALL_LOAD_USE] += tm->penalties[PENALTY_LOAD_USE];
+    tm->loadedRegs = isLoad(d->op) ? 1u << d->rd : 0;
+}
+
+static void timingModelReport(Observer *obs, const Z16Machine *, FILE *out) {
+    TimingModel *tm = (TimingModel *)obs;
+    uint64_t cycles = tm->baseCycles;
+    for (int k = 0; k < STALL_KINDS; k++)
+        cycles += tm->stalls[k];
+    fprintf(out, "Timing:\n");
+    fprintf(out, "  %-12s %14llu\n", "instructions", (unsigned long long)tm->instructions);
+    fprintf(out, "  %-12s %14llu\n", "cycles", (unsigned long long)cycles);
+    fprintf(out, "  %-12s %14.3f\n", "CPI", tm->instructions ? (double)cycles / tm->instructions : 0.0);
+    fprintf(out, "  %-12s %14llu %7.2f%%\n", "base", (unsigned long long)tm->baseCycles,
+            cycles ? 100.0 * tm->baseCycles / cycles : 0.0);
+    for (int k = 0; k < STALL_KINDS; k++)
+        fprintf(out, "  %-12s %14llu %7.2f%%\n", stallNames[k], (unsigned long long)tm->stalls[k],
+                cycles ? 100.0 * tm->stalls[k] / cycles : 0.0);
+}
+
+static void timingModelDestroy(Observer *obs) {
+    free(obs);
+}
+
+// Reads "name cycles" lines from 'path' into the class and penalty tables. Returns 0 on an
+// unreadable file or an unknown name.
+static int loadTimingConfig(const char *path, uint8_t *classCycles, uint32_t *penalties) {
+    FILE *fp = fopen(path, "r");
+    if (!fp) {
+        perror("Error opening timing config");
+        return 0;
+    }
+    char line[256];
+    int lineNo = 0, ok = 1;
+    while (ok && fgets(line, sizeof(line), fp)) {
+        lineNo++;
+        line[strcspn(line, "#\r\n")] = '\0';
+        char name[32];
+        unsigned long cycles;
+        int fields = sscanf(line, "%31s %lu", name, &cycles);
+        if (fields <= 0)
+            continue;
+        int c = fields == 2 ? lookupName(name, classNames, CLASS_COUNT) : -1;
+        int p = fields == 2 ? lookupName(name, penaltyNames, PENALTY_COUNT) : -1;
+        if (c >= 0 && cycles >= 1 && cycles <= 255) {
+            classCycles[c] = (uint8_t)cycles;
+        } else if (p >= 0) {
+            penalties[p] = (uint32_t)cycles;
+        } else {
+            fprintf(stderr, "%s:%d: expected a class (1-255 cycles) or penalty and a cycle count\n", path, lineNo);
+            ok = 0;
+        }
+    }
+    fclose(fp);
+    return ok;
+}
+
+// Builds the timing model from the config at 'path' (NULL: defaults). Returns NULL if the
+// config cannot be read.
+Observer *createTimingModel(const char *path) {
+    uint8_t classCycles[CLASS_COUNT];
+    uint32_t penalties[PENALTY_COUNT];
+    memcpy(classCycles, defaultClassCycles, sizeof(classCycles));
+    memcpy(penalties, defaultPenaltyCycles, sizeof(penalties));
+    if (path && !loadTimingConfig(path, classCycles, penalties))
+        return NULL;
+
+    TimingModel *tm = (TimingModel *)calloc(1, sizeof(TimingModel));
+    tm->base.retire = timingModelRetire;
+    tm->base.report = timingModelReport;
+    tm->base.destroy = timingModelDestroy;
+    for (int op = 0; op < OP_COUNT; op++)
+        tm->latencies[op] = classCycles[opClass(op)];
+    memcpy(tm->penalties, penalties, sizeof(penalties));
+    return &tm->base;
+}
+
+// The per-operation latencies to stamp into decoded entries.
+const uint8_t *timingLatencies(const Observer *timing) {
+    return ((const TimingModel *)timing)->latencies;
+}
+
+// -----------------------
+// Tracing
+// -----------------------
+//
+// The stepping loop used by --engine=reference and whenever a trace, a profile, call
+// stacks, observers or coverage are requested. The trace level and the set of hooks are
+// template parameters, so the choice is made once before the loop starts and a plain run
+// carries no per-instruction checks. Trace lines are formatted into a local buffer and
+// appended to stdout with a single fwrite.
+enum { TRACE_NONE, TRACE_PC, TRACE_DISASM, TRACE_FULL };
+[[maybe_unused]] static const char *traceNames[] = {"none", "pc", "disasm", "full"}; // read by main only
+
+static const char hexDigits[] = "0123456789ABCDEF";
+
+static inline char *appendHex16(char *p, uint16_t v) {
+    p[0] = hexDigits[v >> 12];
+    p[1] = hexDigits[(v >> 8) & 0xF];
+    p[2] = hexDigits[(v >> 4) & 0xF];
+    p[3] = hexDigits[v & 0xF];
+    return p + 4;
+}
+
+enum {
+    HOOK_BINARY = 1, HOOK_PROFILE = 2, HOOK_CALLS = 4, HOOK_OBSERVE = 8, HOOK_COVERAGE = 16,
+    HOOK_COMBINATIONS = 32
+};
+
+template <int LEVEL, unsigned HOOKS>
+static void runTraced(Z16Machine *m) {
+    constexpr bool BINARY = HOOKS & HOOK_BINARY;
+    constexpr bool PROFILE = HOOKS & HOOK_PROFILE;
+    constexpr bool CALLS = HOOKS & HOOK_CALLS;
+    constexpr bool OBSERVE = HOOKS & HOOK_OBSERVE;
+    constexpr bool COVERAGE = HOOKS & HOOK_COVERAGE;
+    char line[256];
+    const uint64_t limit = m->instLimit ? m->instLimit : UINT64_MAX;
+
+    while (1) {
+        if (m->instret == limit) {
+            m->exitReason = EXIT_INST_LIMIT;
+            break;
+        }
+        m->instret++;
+        uint16_t inst = loadWord(m, m->pc);
+
+        if (LEVEL != TRACE_NONE) {
+            char *p = line;
+            *p++ = '0';
+            *p++ = 'x';
+            p = appendHex16(p, m->pc);
+            if (LEVEL >= TRACE_DISASM) {
+                *p++ = ':';
+                *p++ = ' ';
+                p += disassemble(inst, m->pc, p, line + sizeof(line) - p);
+            }
+            *p++ = '\n';
+            fwrite(line, 1, p - line, stdout);
+        }
+
+        // Decode once per static instruction; later visits reuse the cached entry
+        DecodedInst *cached = &m->decodeCache[m->pc >> 1];
+        if (cached->op == OP_UNDECODED) {
+            *cached = decodeInstruction(inst);
+            if (OBSERVE && m->latencies)
+                cached->cycles = m->latencies[cached->op];
+        }
+        // Every hook works on this copy: the instruction may overwrite its own word, and
+        // the store then drops the cache entry
+        const DecodedInst decoded = *cached;
+        const DecodedInst *d = &decoded;
+
+        uint16_t instPc = m->pc;
+        if (PROFILE)
+            profileInstruction(m->profile, instPc, d->op);
+        if (CALLS)
+            callSample(m->calls);
+        if (COVERAGE)
+            coverInstruction(m->coverage, m, d, instPc);
+
+        uint16_t where = 0, value = 0;
+        if (BINARY && (d->op == OP_SB || d->op == OP_SW)) {
+            where = m->regs[d->rd] + d->imm;
+            value = d->op == OP_SB ? m->regs[d->rs2] & 0xFF : m->regs[d->rs2];
+        }
+
+        // Terminates on ecall 3 or when execution runs past the end of memory
+        Retired retired;
+        if (OBSERVE) {
+            retired.pc = instPc;
+            retired.d = d;
+            retired.addr = isLoad(d->op) || isStore(d->op) ? memoryAddress(m, d) : 0;
+            retired.fetchMiss = retired.dataMiss = MISS_NONE;
+            retired.mispredicted = 0;
+        }
+
+        int running = executeDecoded(m, d);
+        if (OBSERVE) {
+            retired.nextPc = m->pc;
+            for (Observer *obs = m->observers; obs; obs = obs->next)
+                obs->retire(obs, &retired);
+        }
+        if (PROFILE)
+            profileBackEdge(m->profile, d, instPc, m->pc);
+        if (CALLS)
+            callTransfer(m->calls, d, m->pc);
+
+        if (BINARY) {
+            if (writesRd(d->op)) {
+                where = d->rd;
+                value = m->regs[d->rd];
+            }
+            traceAppend(m->trace, instPc, inst, where, value);
+        }
+
+        if (LEVEL == TRACE_FULL) { // register file after the instruction
+            char *p = line;
+            for (int r = 0; r < 8; r++) {
+                size_t len = strlen(regNames[r]);
+                *p++ = ' ';
+                memcpy(p, regNames[r], len);
+                p += len;
+                *p++ = '=';
+                p = appendHex16(p, m->regs[r]);
+            }
+            *p++ = '\n';
+            fwrite(line, 1, p - line, stdout);
+        }
+
+        if (!running)
+            break;
+    }
+}
+
+typedef void (*SteppingLoop)(Z16Machine *m);
+
+typedef struct {
+    SteppingLoop entries[TRACE_FULL + 1][HOOK_COMBINATIONS];
+} SteppingLoopTable;
+
+template <int... N>
+static constexpr SteppingLoopTable makeSteppingLoops(std::integer_sequence<int, N...>) {
+    return SteppingLoopTable{{runTraced<N / HOOK_COMBINATIONS, N % HOOK_COMBINATIONS>...}};
+}
+
+// One stepping loop per trace level and hook combination.
+static constexpr SteppingLoopTable steppingLoops =
+    makeSteppingLoops(std::make_integer_sequence<int, (TRACE_FULL + 1) * HOOK_COMBINATIONS>());
+
+// Runs the stepping loop, recording a binary trace when the machine has a trace writer,
+// counting executions when it has a profile, sampling call stacks when it has them,
+// feeding its observers and recording coverage when it has a bitmap.
+void runStepping(Z16Machine *m, int traceLevel) {
+    unsigned hooks = (m->trace ? HOOK_BINARY : 0) | (m->profile ? HOOK_PROFILE : 0) |
+                     (m->calls ? HOOK_CALLS : 0) | (m->observers ? HOOK_OBSERVE : 0) |
+                     (m->coverage ? HOOK_COVERAGE : 0);
+    steppingLoops.entries[traceLevel > TRACE_FULL ? TRACE_FULL : traceLevel][hooks](m);
+}
+
+// -----------------------
+// Differential Check
+// -----------------------
+//
+// Reruns the program from 'img' (and the snapshot 'start' of it, if any) through
+// executeInstruction() and compares the final registers, PC, memory, instruction count and
+// exit reason with the state the selected engine left behind. Returns 1 when they match.
+int verifyAgainstReference(Z16Machine *m, const Z16Image *img, const Z16Snapshot *start, const char *engineName) {
+    unsigned char *engineMemory = (unsigned char *)malloc(MEM_SIZE); // per call: machines verify concurrently
+    uint16_t engineRegs[8];
+    uint16_t enginePc = m->pc;
+    uint64_t engineInstret = m->instret;
+    int engineExit = m->exitReason;
+    memcpy(engineMemory, m->memory, MEM_SIZE);
+    memcpy(engineRegs, m->regs, sizeof(engineRegs));
+
+    loadImage(m, img);
+    if (start)
+        restoreSnapshot(m, start);
+    OutputFn output = m->output;
+    m->output = NULL; // the program's output was already printed by the engine run
+    const uint64_t limit = m->instLimit ? m->instLimit : UINT64_MAX;
+    while (m->instret < limit) {
+        m->instret++;
+        if (!executeInstruction(m, loadWord(m, m->pc)))
+            break;
+    }
+    if (m->instret == limit && m->exitReason == EXIT_NONE)
+        m->exitReason = EXIT_INST_LIMIT;
+    m->output = output;
+    uint16_t *regs = m->regs;
+    uint16_t pc = m->pc;
+    unsigned char *memory = m->memory;
+
+    int mismatches = 0;
+    if (pc != enginePc) {
+        fprintf(stderr, "verify: pc: %s 0x%04X, reference 0x%04X\n", engineName, enginePc, pc);
+        mismatches++;
+    }
+    if (m->instret != engineInstret || m->exitReason != engineExit) {
+        fprintf(stderr, "verify: exit: %s %s after %llu instructions, reference %s after %llu\n",
+                engineName, exitNames[engineExit], (unsigned long long)engineInstret,
+                exitNames[m->exitReason], (unsigned long long)m->instret);
+        mismatches++;
+    }
+    for (int r = 0; r < 8; r++) {
+        if (regs[r] != engineRegs[r]) {
+            fprintf(stderr, "verify: %s: %s 0x%04X, reference 0x%04X\n", regNames[r], engineName,
+                    engineRegs[r], regs[r]);
+            mismatches++;
+        }
+    }
+    for (int addr = 0; addr < MEM_SIZE; addr++) {
+        if (memory[addr] != engineMemory[addr]) {
+            if (mismatches < 16)
+                fprintf(stderr, "verify: mem[0x%04X]: %s 0x%02X, reference 0x%02X\n", addr,
+                        engineName, engineMemory[addr], memory[addr]);
+            mismatches++;
+        }
+    }
+
+    if (mismatches)
+        fprintf(stderr, "verify: %s differs from reference (%d mismatches)\n", engineName, mismatches);
+    else
+        fprintf(stderr, "verify: %s matches reference\n", engineName);
+    free(engineMemory);
+    return mismatches == 0;
+}
+
+// -----------------------
+// Engine Selection
+// -----------------------
+enum { ENGINE_REFERENCE, ENGINE_THREADED, ENGINE_BLOCK, ENGINE_JIT };
+static const char *engineNames[] = {"reference", "threaded", "block", "jit"};
+
+// Runs 'm' from its current PC on the given engine, without tracing, until it stops.
+void runEngine(Z16Machine *m, int engine) {
+    switch (engine) {
+        case ENGINE_THREADED: runThreaded(m); break;
+        case ENGINE_BLOCK:    runBlocks(m, 0); break;
+        case ENGINE_JIT:      runBlocks(m, 1); break;
+        default:              runStepping(m, TRACE_NONE); break;
+    }
+}
+
+// -----------------------
+// Reverse Debugging
+// -----------------------
+//
+// --debug runs the program under a command loop that can move both forwards and backwards.
+// Going back never undoes anything. The debugger restores the latest checkpoint at or
+// before the target and re-executes forward to it. This is exact because execution is
+// deterministic once input is fixed. Each input read reaches the real source once, the
+// first time execution gets there; re-execution is served from the session's history of
+// reads. Output is printed only the first time too.
+//
+// A checkpoint is a snapshot (registers plus the pages that differ from the image, see
+// "Snapshots"). One is taken whenever execution first gets a checkpoint interval past the
+// latest one (--checkpoint-interval, default DEBUG_CHECKPOINT_INTERVAL). Checkpoints must
+// stay within DEBUG_CHECKPOINTS_MAX and within the --checkpoint-memory budget. When they go
+// over, every second one is dropped and the interval doubles. So memory stays bounded on
+// runs of billions of instructions, and a step back re-executes at most one interval.
+// Re-execution runs on the selected engine; only breakpoint searches step one instruction
+// at a time.
+//
+// Commands, one per line (an empty line repeats the previous command):
+//   step [N], s           execute N instructions (default 1)
+//   continue, c           run until a breakpoint, halt, or the instruction limit
+//   step-back [N], sb     go back N instructions (default 1)
+//   reverse-continue, rc  go back to the latest breakpoint hit, or to the start
+//   break ADDR, b         stop when the PC reaches ADDR
+//   delete [ADDR], d      remove the breakpoint at ADDR, or all of them
+//   regs, r               show the registers
+//   x ADDR [N]            show N memory words from ADDR (default 8)
+//   checkpoints           show the checkpoint count, interval and memory
+//   quit, q
+#define DEBUG_CHECKPOINT_INTERVAL 100000
+#define DEBUG_CHECKPOINTS_MAX 256
+#define DEBUG_CHECKPOINT_MEMORY (16 << 20)
+
+typedef struct {
+    Z16Snapshot *snap;
+    size_t reads; // input reads before the checkpoint
+    size_t bytes;
+} Checkpoint;
+
+typedef struct Debugger {
+    Z16Machine *m;
+    const Z16Image *img;
+    int engine;
+    uint64_t instLimit; // the run's --inst-limit (0: none)
+    std::vector<Checkpoint> checkpoints; // ascending; the first is where the session started
+    uint64_t interval;
+    size_t memoryBudget;
+    size_t memoryUsed;
+    std::vector<uint16_t> reads; // every value the program has read, in order
+    size_t nextRead;
+    InputFn source; // where values are read the first time
+    void *sourceCtx;
+    OutputFn output;
+    void *outputCtx;
+    uint64_t frontier; // furthest instruction count reached so far
+    uint64_t breakpoints[MEM_SIZE / 2 / 64];
+    int breakpointCount;
+} Debugger;
+
+static uint16_t debugInput(Z16Machine *m, int source) {
+    Debugger *dbg = (Debugger *)m->inputCtx;
+    if (dbg->nextRead == dbg->reads.size()) { // first time execution gets here
+        uint16_t value = 0xFFFF;
+        if (dbg->source) {
+            m->inputCtx = dbg->sourceCtx;
+            value = dbg->source(m, source);
+            m->inputCtx = dbg;
+        }
+        dbg->reads.push_back(value);
+    }
+    return dbg->reads[dbg->nextRead++];
+}
+
+static void debugOutput(Z16Machine *m, const char *data, size_t len) {
+    Debugger *dbg = (Debugger *)m->outputCtx;
+    if (m->instret > dbg->frontier && dbg->output) { // not printed before
+        m->outputCtx = dbg->outputCtx;
+        dbg->output(m, data, len);
+        m->outputCtx = dbg;
+    }
+}
+
+static inline int isBreakpoint(const Debugger *dbg, uint16_t pc) {
+    return (dbg->breakpoints[pc >> 7] >> ((pc >> 1) & 63)) & 1;
+}
+
+static void addCheckpoint(Debugger *dbg) {
+    Checkpoint cp;
+    cp.snap = takeSnapshot(dbg->m, dbg->img);
+    cp.reads = dbg->nextRead;
+    cp.bytes = sizeof(Z16Snapshot) + (size_t)cp.snap->pageCount * cp.snap->pageSize +
+               DIRTY_PAGES_MAX * sizeof(uint16_t);
+    dbg->checkpoints.push_back(cp);
+    dbg->memoryUsed += cp.bytes;
+    while (dbg->checkpoints.size() > 2 &&
+           (dbg->checkpoints.size() > DEBUG_CHECKPOINTS_MAX || dbg->memoryUsed > dbg->memoryBudget)) {
+        size_t kept = 1; // the session start stays
+        for (size_t i = 1; i < dbg->checkpoints.size(); i++) {
+            if (i % 2 == 0) {
+                dbg->checkpoints[kept++] = dbg->checkpoints[i];
+            } else {
+                dbg->memoryUsed -= dbg->checkpoints[i].bytes;
+                freeSnapshot(dbg->checkpoints[i].snap);
+            }
+        }
+        dbg->checkpoints.resize(kept);
+        dbg->interval *= 2;
+    }
+}
+
+static void restoreCheckpoint(Debugger *dbg, size_t i) {
+    restoreSnapshot(dbg->m, dbg->checkpoints[i].snap);
+    dbg->nextRead = dbg->checkpoints[i].reads;
+}
+
+// Executes one instruction, decoded straight from memory: stepping alternates with
+// runEngine(), so the predecode cache is not trusted here.
+static void debugStep(Z16Machine *m) {
+    m->instret++;
+    executeInstruction(m, loadWord(m, m->pc));
+}
+
+// Runs until instruction count 'target', the program stops or, with 'stopAtBreakpoints',
+// the PC reaches a breakpoint after at least one instruction. Takes checkpoints on the way
+// when execution gets further than before.
+static void debugForward(Debugger *dbg, uint64_t target, int stopAtBreakpoints) {
+    Z16Machine *m = dbg->m;
+    uint64_t limit = dbg->instLimit && dbg->instLimit < target ? dbg->instLimit : target;
+    int moved = 0, atBreakpoint = 0;
+    while (m->exitReason == EXIT_NONE && m->instret < limit && !atBreakpoint) {
+        uint64_t nextCheckpoint = dbg->checkpoints.back().snap->instret + dbg->interval;
+        if (m->instret >= nextCheckpoint) {
+            addCheckpoint(dbg);
+            continue;
+        }
+        uint64_t chunkEnd = std::min(limit, nextCheckpoint);
+        if (stopAtBreakpoints && dbg->breakpointCount) {
+            while (m->exitReason == EXIT_NONE && m->instret < chunkEnd) {
+                if ((atBreakpoint = moved && isBreakpoint(dbg, m->pc)))
+                    break;
+                debugStep(m);
+                moved = 1;
+            }
+        } else {
+            m->instLimit = chunkEnd;
+            runEngine(m, dbg->engine);
+            m->instLimit = 0;
+            if (m->exitReason == EXIT_INST_LIMIT)
+                m->exitReason = EXIT_NONE;
+        }
+    }
+    if (m->exitReason == EXIT_NONE && dbg->instLimit && m->instret == dbg->instLimit)
+        m->exitReason = EXIT_INST_LIMIT;
+    dbg->frontier = std::max(dbg->frontier, m->instret);
+}
+
+// Index of the latest checkpoint at or before instruction count 'instret'.
+static size_t checkpointBefore(const Debugger *dbg, uint64_t instret) {
+    size_t lo = 0, hi = dbg->checkpoints.size();
+    while (hi - lo > 1) {
+        size_t mid = (lo + hi) / 2;
+        if (dbg->checkpoints[mid].snap->instret <= instret)
+            lo = mid;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+// Puts the machine into its state after 'target' instructions (no earlier than the start
+// of the session).
+static void debugSeek(Debugger *dbg, uint64_t target) {
+    target = std::max(target, dbg->checkpoints[0].snap->instret);
+    restoreCheckpoint(dbg, checkpointBefore(dbg, target));
+    debugForward(dbg, target, 0);
+}
+
+// Goes back to the latest earlier point where the PC was at a breakpoint. Returns 0 (at
+// the start of the session) if there is none.
+static int reverseContinue(Debugger *dbg) {
+    Z16Machine *m = dbg->m;
+    uint64_t current = m->instret;
+    if (current == dbg->checkpoints[0].snap->instret)
+        return 0;
+    for (size_t i = checkpointBefore(dbg, current - 1) + 1; i-- > 0;) {
+        uint64_t end = current;
+        if (i + 1 < dbg->checkpoints.size())
+            end = std::min(end, dbg->checkpoints[i + 1].snap->instret);
+        restoreCheckpoint(dbg, i);
+        uint64_t hit = UINT64_MAX;
+        while (m->exitReason == EXIT_NONE && m->instret < end) {
+            if (isBreakpoint(dbg, m->pc))
+                hit = m->instret;
+            debugStep(m);
+        }
+        if (hit != UINT64_MAX) {
+            debugSeek(dbg, hit);
+            return 1;
+        }
+    }
+    debugSeek(dbg, dbg->checkpoints[0].snap->instret);
+    return 0;
+}
+
+static void showLocation(const Z16Machine *m) {
+    char text[64];
+    disassemble(loadWord(m, m->pc), m->pc, text, sizeof(text));
+    fflush(stdout);
+    printf("[%llu] 0x%04X: %s", (unsigned long long)m->instret, m->pc, text);
+    if (m->exitReason != EXIT_NONE)
+        printf("  (%s)", exitNames[m->exitReason]);
+    printf("\n");
+}
+
+// Runs the command loop on 'm', reading commands from 'commands'. Execution resumes from
+// the machine's current state on 'engine'; input is read through the machine's InputFn.
+void runDebugger(Z16Machine *m, const Z16Image *img, int engine, FILE *commands, uint64_t interval,
+                 size_t memoryBudget) {
+    Debugger *dbg = new Debugger();
+    dbg->m = m;
+    dbg->img = img;
+    dbg->engine = engine;
+    dbg->instLimit = m->instLimit;
+    dbg->interval = interval;
+    dbg->memoryBudget = memoryBudget;
+    dbg->source = m->input;
+    dbg->sourceCtx = m->inputCtx;
+    dbg->output = m->output;
+    dbg->outputCtx = m->outputCtx;
+    dbg->frontier = m->instret;
+    m->input = debugInput;
+    m->inputCtx = dbg;
+    m->output = debugOutput;
+    m->outputCtx = dbg;
+    m->instLimit = 0;
+    addCheckpoint(dbg);
+    showLocation(m);
+
+    char line[256], last[256] = "";
+    while (1) {
+        printf("(z16) ");
+        fflush(stdout);
+        if (!fgets(line, sizeof(line), commands))
+            break;
+        if (strspn(line, " \t\r\n") == strlen(line))
+            memcpy(line, last, sizeof(line));
+        else
+            memcpy(last, line, sizeof(last));
+        char command[32] = "";
+        char arg[2][64] = {"", ""};
+        sscanf(line, "%31s %63s %63s", command, arg[0], arg[1]);
+        unsigned long long n = *arg[0] ? strtoull(arg[0], NULL, 0) : 1;
+        if (!strcmp(command, "step") || !strcmp(command, "s")) {
+            debugForward(dbg, m->instret + n, 0);
+            showLocation(m);
+        } else if (!strcmp(command, "continue") || !strcmp(command, "c")) {
+            debugForward(dbg, UINT64_MAX, 1);
+            showLocation(m);
+        } else if (!strcmp(command, "step-back") || !strcmp(command, "sb")) {
+            debugSeek(dbg, m->instret > n ? m->instret - n : 0);
+            showLocation(m);
+        } else if (!strcmp(command, "reverse-continue") || !strcmp(command, "rc")) {
+            if (!reverseContinue(dbg))
+                printf("No earlier breakpoint hit; at the start\n");
+            showLocation(m);
+        } else if ((!strcmp(command, "break") || !strcmp(command, "b")) && *arg[0]) {
+            uint16_t addr = (uint16_t)n & 0xFFFE;
+            if (!isBreakpoint(dbg, addr))
+                dbg->breakpointCount++;
+            dbg->breakpoints[addr >> 7] |= 1ULL << ((addr >> 1) & 63);
+            printf("Breakpoint at 0x%04X\n", addr);
+        } else if (!strcmp(command, "delete") || !strcmp(command, "d")) {
+            if (*arg[0]) {
+                uint16_t addr = (uint16_t)n & 0xFFFE;
+                dbg->breakpointCount -= isBreakpoint(dbg, addr);
+                dbg->breakpoints[addr >> 7] &= ~(1ULL << ((addr >> 1) & 63));
+            } else {
+                memset(dbg->breakpoints, 0, sizeof(dbg->breakpoints));
+                dbg->breakpointCount = 0;
+            }
+        } else if (!strcmp(command, "regs") || !strcmp(command, "r")) {
+            printf("pc=0x%04X instructions=%llu\n", m->pc, (unsigned long long)m->instret);
+            for (int r = 0; r < 8; r++)
+                printf("%s=0x%04X%c", regNames[r], m->regs[r], r == 7 ? '\n' : ' ');
+        } else if (!strcmp(command, "x") && *arg[0]) {
+            uint16_t addr = (uint16_t)n & 0xFFFE;
+            unsigned long count = *arg[1] ? strtoul(arg[1], NULL, 0) : 8;
+            for (unsigned long i = 0; i < count; i++, addr += 2)
+                printf("0x%04X: 0x%04X%s", addr, loadWord(m, addr), i % 4 == 3 || i + 1 == count ? "\n" : "  ");
+        } else if (!strcmp(command, "checkpoints")) {
+            printf("%zu checkpoints every %llu instructions, %zu bytes\n", dbg->checkpoints.size(),
+                   (unsigned long long)dbg->interval, dbg->memoryUsed);
+        } else if (!strcmp(command, "quit") || !strcmp(command, "q")) {
+            break;
+        } else {
+            printf("Commands: step [N], continue, step-back [N], reverse-continue, break ADDR, "
+                   "delete [ADDR], regs, x ADDR [N], checkpoints, quit\n");
+        }
+    }
+
+    for (const Checkpoint &cp : dbg->checkpoints)
+        freeSnapshot(cp.snap);
+    m->input = dbg->source;
+    m->inputCtx = dbg->sourceCtx;
+    m->output = dbg->output;
+    m->outputCtx = dbg->outputCtx;
+    m->instLimit = dbg->instLimit;
+    delete dbg;
+}
+
+// -----------------------
+// Batch Runner
+// -----------------------
+//
+// --batch runs every image listed in a manifest (one path per line, relative to the
+// current directory; blank lines and lines starting with '#' are skipped) on a pool of
+// worker threads. Each worker owns one machine and reloads it for every task, so tasks
+// share nothing and the workers never contend on simulator state. Ecall output goes into
+// the worker's capture buffer and is reduced to a length and an FNV-1a hash. With coverage
+// requested, every worker runs the stepping loop into a bitmap of its own and ORs it into
+// the run's when it finishes.
+//
+// Each distinct path is opened once, by the first task that needs it, and closed after
+// its last task: tasks running the same binary share its pages copy-on-write, and only
+// images in use hold a file descriptor.
+//
+// Scheduling is work stealing over task index ranges. Every worker starts with an equal
+// slice of the manifest and takes tasks from the front of its own range; a worker that
+// runs dry takes the back half of another worker's range. A range is one 64-bit atomic
+// (begin << 32 | end), so both taking and stealing are a single compare-and-swap.
+typedef struct {
+    std::string path;
+    int image;  // index into BatchRun::images
+    int loaded;
+    int exitReason;
+    uint64_t instret;
+    size_t outputBytes;
+    uint64_t outputHash;
+} BatchTask;
+
+typedef struct {
+    std::once_flag opened;
+    Z16Image *img;          // NULL if the file could not be opened
+    std::atomic<int> users; // tasks still to run this image
+} BatchImage;
+
+struct alignas(64) BatchQueue { // one cache line each, so owners do not false-share
+    std::atomic<uint64_t> range;
+};
+
+typedef struct {
+    std::vector<BatchTask> *tasks;
+    BatchImage *images;
+    BatchQueue *queues;
+    int workers;
+    int engine;
+    int jitThreshold;
+    uint64_t instLimit;
+    Coverage *coverage; // union of every task's coverage, if recorded
+    std::mutex coverageLock;
+} BatchRun;
+
+static void captureOutput(Z16Machine *m, const char *data, size_t len) {
+    ((std::string *)m->outputCtx)->append(data, len);
+}
+
+static inline uint64_t packRange(uint32_t begin, uint32_t end) {
+    return ((uint64_t)begin << 32) | end;
+}
+
+// Takes the next task from the front of the worker's own range.
+static int batchTake(BatchQueue *q, uint32_t *task) {
+    uint64_t r = q->range.load(std::memory_order_relaxed);
+    while (1) {
+        uint32_t begin = r >> 32, end = (uint32_t)r;
+        if (begin >= end)
+            return 0;
+        if (q->range.compare_exchange_weak(r, packRange(begin + 1, end))) {
+            *task = begin;
+            return 1;
+        }
+    }
+}
+
+// Steals the back half of some other worker's range, keeps its first task in 'task' and
+// makes the rest the thief's own range. Returns 0 once every range is empty.
+static int batchSteal(BatchRun *run, int self, uint32_t *task) {
+    for (int i = 1; i < run->workers; i++) {
+        BatchQueue *victim = &run->queues[(self + i) % run->workers];
+        uint64_t r = victim->range.load(std::memory_order_relaxed);
+        while (1) {
+            uint32_t begin = r >> 32, end = (uint32_t)r;
+            if (begin >= end)
+                break;
+            uint32_t split = end - (end - begin + 1) / 2;
+            if (victim->range.compare_exchange_weak(r, packRange(begin, split))) {
+                *task = split;
+                run->queues[self].range.store(packRange(split + 1, end));
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
+
+static void batchWorker(BatchRun *run, int self) {
+    Z16Machine *m = createMachine();
+    std::string output;
+    m->output = captureOutput;
+    m->outputCtx = &output;
+    m->jitThreshold = run->jitThreshold;
+    m->instLimit = run->instLimit;
+    if (run->coverage)
+        m->coverage = (Coverage *)calloc(1, sizeof(Coverage));
+
+    uint32_t index;
+    while (batchTake(&run->queues[self], &index) || batchSteal(run, self, &index)) {
+        BatchTask *t = &(*run->tasks)[index];
+        BatchImage *bi = &run->images[t->image];
+        std::call_once(bi->opened, [&] { bi->img = openImage(t->path.c_str()); });
+        output.clear();
+        resetMachine(m);
+        t->loaded = bi->img != NULL;
+        if (t->loaded) {
+            loadImage(m, bi->img);
+            if (m->coverage) // recording needs the stepping loop's hook
+                runStepping(m, TRACE_NONE);
+            else
+                runEngine(m, run->engine);
+        }
+        if (--bi->users == 0 && bi->img)
+            closeImage(bi->img);
+
+        uint64_t hash = FNV_OFFSET;
+        for (size_t i = 0; i < output.size(); i++)
+            hash = (hash ^ (unsigned char)output[i]) * FNV_PRIME;
+        t->exitReason = m->exitReason;
+        t->instret = m->instret;
+        t->outputBytes = output.size();
+        t->outputHash = hash;
+    }
+    if (m->coverage) {
+        std::lock_guard<std::mutex> lock(run->coverageLock);
+        mergeCoverage(run->coverage, m->coverage);
+    }
+    destroyMachine(m);
+}
+
+// Runs every image in 'manifest' and writes one result line per image, in manifest order,
+// to 'resultPath' (stdout when NULL). With 'coverage', ORs the coverage of every task into
+// it. Returns 0 when every image loaded.
+int runBatch(const char *manifest, const char *resultPath, int jobs, int engine,
+             int jitThreshold, uint64_t instLimit, Coverage *coverage) {
+    FILE *fp = fopen(manifest, "r");
+    if (!fp) {
+        perror("Error opening batch manifest");
+        return 1;
+    }
+    std::vector<BatchTask> tasks;
+    std::unordered_map<std::string, int> imageIndex;
+    char line[4096];
+    while (fgets(line, sizeof(line), fp)) {
+        char *p = line;
+        while (isspace((unsigned char)*p))
+            p++;
+        size_t len = strlen(p);
+        while (len && isspace((unsigned char)p[len - 1]))
+            p[--len] = '\0';
+        if (len == 0 || p[0] == '#')
+            continue;
+        BatchTask t = {};
+        t.path = p;
+        t.image = imageIndex.emplace(t.path, (int)imageIndex.size()).first->second;
+        tasks.push_back(t);
+    }
+    fclose(fp);
+
+    FILE *out = stdout;
+    if (resultPath && !(out = fopen(resultPath, "w"))) {
+        perror("Error opening batch result file");
+        return 1;
+    }
+
+    BatchImage *images = new BatchImage[imageIndex.size()];
+    for (size_t i = 0; i < imageIndex.size(); i++) {
+        images[i].img = NULL;
+        images[i].users = 0;
+    }
+    for (const BatchTask &t : tasks)
+        images[t.image].users++;
+
+    if (jobs < 1)
+        jobs = (int)std::thread::hardware_concurrency();
+    if (jobs < 1)
+        jobs = 1;
+    if ((size_t)jobs > tasks.size())
+        jobs = tasks.size() ? (int)tasks.size() : 1;
+
+    BatchRun run;
+    run.tasks = &tasks;
+    run.images = images;
+    run.queues = new BatchQueue[jobs];
+    run.workers = jobs;
+    run.engine = engine;
+    run.jitThreshold = jitThreshold;
+    run.instLimit = instLimit;
+    run.coverage = coverage;
+    for (int w = 0; w < jobs; w++)
+        run.queues[w].range.store(packRange((uint32_t)(tasks.size() * w / jobs),
+                                            (uint32_t)(tasks.size() * (w + 1) / jobs)));
+
+    auto start = std::chrono::steady_clock::now();
+    std::vector<std::thread> threads;
+    for (int w = 1; w < jobs; w++)
+        threads.emplace_back(batchWorker, &run, w);
+    batchWorker(&run, 0);
+    for (auto &t : threads)
+        t.join();
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    delete[] run.queues;
+    delete[] images;
+
+    int failed = 0;
+    uint64_t totalInsts = 0;
+    fprintf(out, "# image\texit\tinstructions\toutput_bytes\toutput_fnv1a\n");
+    for (const BatchTask &t : tasks) {
+        if (!t.loaded) {
+            fprintf(out, "%s\tload-error\t0\t0\t-\n", t.path.c_str());
+            failed++;
+            continue;
+        }
+        fprintf(out, "%s\t%s\t%llu\t%zu\t%016llx\n", t.path.c_str(), exitNames[t.exitReason],
+                (unsigned long long)t.instret, t.outputBytes, (unsigned long long)t.outputHash);
+        totalInsts += t.instret;
+    }
+    if (out != stdout)
+        fclose(out);
+
+    fprintf(stderr, "batch: %zu images (%d failed to load), %llu instructions in %.3f s on %d threads\n",
+            tasks.size(), failed, (unsigned long long)totalInsts, seconds, jobs);
+    return failed ? 1 : 0;
+}
+
+// -----------------------
+// Fuzzing Harness
+// -----------------------
+//
+// Runs a guest program once per fuzz input without leaving the process. The image is
+// loaded once and run from reset until the PC first reaches the entry address (the
+// snapshot point, typically just after the firmware's initialization), and that state is
+// kept as an in-memory snapshot. Every input then restores the snapshot (dirty pages
+// only), writes the input bytes to the guest buffer, sets a0 to their count and a1 to the
+// buffer address, and runs until ecall 3, a fault or the instruction limit. Running past
+// the end of memory or executing an illegal encoding is a crash.
+//
+// Each taken or not-taken branch and each jump adds to an edge counter in a 64KB map,
+// indexed by a hash of the (branch address, next PC) pair. Under libFuzzer (-DZ16_LIBFUZZER,
+// linked with -fsanitize=fuzzer) the map is an extra-counters section, and the harness is
+// configured from the environment: Z16_FUZZ_IMAGE, Z16_FUZZ_ENTRY, Z16_FUZZ_BUFFER,
+// Z16_FUZZ_MAX_LEN and Z16_FUZZ_INST_LIMIT. Built with afl-clang-fast, --fuzz without input
+// files runs AFL's persistent mode on AFL's shared map. Otherwise --fuzz replays input
+// files and reports what they covered.
+#define FUZZ_MAP_SIZE 65536
+#define FUZZ_DEFAULT_MAX_LEN 256
+#define FUZZ_DEFAULT_INST_LIMIT 1000000
+
+enum { FUZZ_OK, FUZZ_CRASH, FUZZ_HANG };
+static const char *const fuzzOutcomeNames[] = {"ok", "crash", "hang"};
+
+typedef struct FuzzHarness {
+    Z16Machine *m;
+    Z16Image *img;
+    Z16Snapshot *start;  // state at the entry address
+    uint16_t buffer;     // guest address the input is copied to
+    uint32_t maxLen;     // longer inputs are truncated
+    uint64_t instLimit;  // per input
+    uint8_t *edges;      // FUZZ_MAP_SIZE edge counters
+} FuzzHarness;
+
+static inline uint32_t fuzzEdgeIndex(uint16_t from, uint16_t to) {
+    return (((from >> 1) * 0x9E3779B1u) >> 16 ^ (to >> 1)) & (FUZZ_MAP_SIZE - 1);
+}
+
+// The stepping loop of the harness: executeDecoded plus an edge counter update after every
+// control transfer. Counters saturate at 255 rather than wrap, so an edge taken a multiple
+// of 256 times still reads as covered.
+static int fuzzExecute(Z16Machine *m, uint8_t *edges) {
+    const uint64_t limit = m->instLimit ? m->instLimit : UINT64_MAX;
+    while (1) {
+        if (m->instret == limit) {
+            m->exitReason = EXIT_INST_LIMIT;
+            return FUZZ_HANG;
+        }
+        m->instret++;
+        DecodedInst *d = &m->decodeCache[m->pc >> 1];
+        if (d->op == OP_UNDECODED)
+            *d = decodeInstruction(loadWord(m, m->pc));
+        const uint8_t op = d->op; // the instruction may overwrite its own cache entry
+        if (op == OP_ILLEGAL)
+            return FUZZ_CRASH;
+        uint16_t pc = m->pc;
+        int running = executeDecoded(m, d);
+        if ((op >= OP_BEQ && op <= OP_BGEU) || op == OP_J || op == OP_JAL || op == OP_JR || op == OP_JALR) {
+            uint8_t *count = &edges[fuzzEdgeIndex(pc, m->pc)];
+            if (*count != 255)
+                ++*count;
+        }
+        if (!running)
+            return m->exitReason == EXIT_END_OF_MEMORY ? FUZZ_CRASH : FUZZ_OK;
+    }
+}
+
+// Loads 'image' and runs it to 'entry' to take the start snapshot. Returns 0 (after
+// reporting why) if the image cannot be read or execution never reaches 'entry'.
+int openFuzzHarness(FuzzHarness *h, const char *image, uint16_t entry, uint16_t buffer, uint32_t maxLen,
+                    uint64_t instLimit, uint8_t *edges) {
+    memset(h, 0, sizeof(*h));
+    if (!(h->img = openImage(image)))
+        return 0;
+    h->m = createMachine();
+    h->m->output = NULL;
+    loadImage(h->m, h->img);
+    h->m->instLimit = instLimit;
+    while (h->m->pc != entry) {
+        if (h->m->instret == instLimit ||
+            (h->m->instret++, !executeInstruction(h->m, loadWord(h->m, h->m->pc)))) {
+            fprintf(stderr, "fuzz: execution did not reach the entry address 0x%04X\n", entry);
+            destroyMachine(h->m);
+            closeImage(h->img);
+            return 0;
+        }
+    }
+    h->start = takeSnapshot(h->m, h->img);
+    h->buffer = buffer;
+    h->maxLen = maxLen;
+    h->instLimit = instLimit;
+    h->edges = edges;
+    return 1;
+}
+
+void closeFuzzHarness(FuzzHarness *h) {
+    freeSnapshot(h->start);
+    destroyMachine(h->m);
+    closeImage(h->img);
+}
+
+// Runs one input from the start snapshot. Returns FUZZ_OK, FUZZ_CRASH or FUZZ_HANG.
+int fuzzOne(FuzzHarness *h, const uint8_t *data, size_t size) {
+    Z16Machine *m = h->m;
+    restoreSnapshot(m, h->start);
+    if (size > h->maxLen)
+        size = h->maxLen;
+    for (size_t i = 0; i < size; i++)
+        storeByte(m, (uint16_t)(h->buffer + i), data[i]);
+    m->regs[6] = (uint16_t)size;
+    m->regs[7] = h->buffer;
+    m->exitReason = EXIT_NONE;
+    m->instLimit = h->start->instret + h->instLimit;
+    return fuzzExecute(m, h->edges);
+}
+
+#if defined(Z16_LIBFUZZER)
+static unsigned long envNumber(const char *name, unsigned long fallback) {
+    const char *value = getenv(name);
+    return value && *value ? strtoul(value, NULL, 0) : fallback;
+}
+
+__attribute__((used, section("__libfuzzer_extra_counters"))) static uint8_t libFuzzerEdges[FUZZ_MAP_SIZE];
+static FuzzHarness libFuzzerHarness;
+
+extern "C" int LLVMFuzzerInitialize(int *, char ***) {
+    const char *image = getenv("Z16_FUZZ_IMAGE");
+    if (!image) {
+        fprintf(stderr, "fuzz: set Z16_FUZZ_IMAGE to the image to fuzz\n");
+        exit(1);
+    }
+    if (!openFuzzHarness(&libFuzzerHarness, image, (uint16_t)envNumber("Z16_FUZZ_ENTRY", 0),
+                         (uint16_t)envNumber("Z16_FUZZ_BUFFER", 0x8000),
+                         (uint32_t)envNumber("Z16_FUZZ_MAX_LEN", FUZZ_DEFAULT_MAX_LEN),
+                         envNumber("Z16_FUZZ_INST_LIMIT", FUZZ_DEFAULT_INST_LIMIT), libFuzzerEdges))
+        exit(1);
+    return 0;
+}
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+    if (fuzzOne(&libFuzzerHarness, data, size) == FUZZ_CRASH)
+        abort();
+    return 0;
+}
+#endif
+
+#if defined(__AFL_FUZZ_TESTCASE_LEN)
+__AFL_FUZZ_INIT();
+extern "C" unsigned char *__afl_area_ptr;
+#endif
+
+// --fuzz: replays 'inputs' through a harness configured like the libFuzzer one, or runs
+// AFL's persistent loop when built with afl-clang-fast and given no inputs. Returns 1 if any
+// input crashed.
+int runFuzz(const char *image, uint16_t entry, uint16_t buffer, uint32_t maxLen, uint64_t instLimit,
+            char **inputs, int inputCount) {
+    static uint8_t edges[FUZZ_MAP_SIZE];
+    FuzzHarness h;
+#if defined(__AFL_FUZZ_TESTCASE_LEN)
+    if (inputCount == 0) {
+        if (!openFuzzHarness(&h, image, entry, buffer, maxLen, instLimit, __afl_area_ptr ? __afl_area_ptr : edges))
+            return 1;
+        __AFL_INIT();
+        unsigned char *data = __AFL_FUZZ_TESTCASE_BUF;
+        while (__AFL_LOOP(100000)) {
+            if (fuzzOne(&h, data, __AFL_FUZZ_TESTCASE_LEN) == FUZZ_CRASH)
+                abort();
+        }
+        closeFuzzHarness(&h);
+        return 0;
+    }
+#endif
+    if (!openFuzzHarness(&h, image, entry, buffer, maxLen, instLimit, edges))
+        return 1;
+    int crashed = 0;
+    std::vector<uint8_t> data;
+    auto startTime = std::chrono::steady_clock::now();
+    for (int i = 0; i < inputCount; i++) {
+        FILE *fp = fopen(inputs[i], "rb");
+        if (!fp) {
+            perror(inputs[i]);
+            continue;
+        }
+        data.clear();
+        int c;
+        while ((c = getc(fp)) != EOF)
+            data.push_back((uint8_t)c);
+        fclose(fp);
+        int outcome = fuzzOne(&h, data.data(), data.size());
+        crashed |= outcome == FUZZ_CRASH;
+        printf("%s\t%s\t%llu\n", inputs[i], fuzzOutcomeNames[outcome],
+               (unsigned long long)(h.m->instret - h.start->instret));
+    }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - startTime).count();
+    uint32_t covered = 0;
+    for (uint32_t i = 0; i < FUZZ_MAP_SIZE; i++)
+        covered += edges[i] != 0;
+    fprintf(stderr, "fuzz: %d inputs, %u edges covered, %.0f execs/s\n", inputCount, covered,
+            seconds > 0 ? inputCount / seconds : 0.0);
+    closeFuzzHarness(&h);
+    return crashed;
+}
+
+// -----------------------
+// Benchmarks
+// -----------------------
+//
+// --bench measures simulator throughput. Each workload is a small Z16 program generated
+// below; the harness runs every workload on every engine with tracing off and reports
+// millions of guest instructions per second, nanoseconds per instruction and host cycles
+// per instruction. Cycles come from the time-stamp counter, which ticks at the nominal
+// clock rate, and are reported only on x86. Each measurement is the best of BENCH_REPEAT
+// runs from a freshly loaded machine, so it includes predecode, translation and JIT
+// warm-up. Ecall output goes to a sink that only counts bytes.
+//
+// Every workload is two nested counted loops around a body: s0 counts outer passes, s1
+// counts inner iterations. Branch offsets are only 5 bits wide, so each loop closes with
+// a bz that skips over a j back to the loop head.
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define Z16_TSC 1
+#else
+#define Z16_TSC 0
+#endif
+
+#define BENCH_REPEAT 3
+#define BENCH_MAX_OUTER 511 // outer passes are loaded as lui (n << 7) then srli 7
+
+enum { X_T0, X_RA, X_SP, X_S0, X_S1, X_T1, X_A0, X_A1 };
+
+typedef struct {
+    uint16_t words[1024];
+    int n;
+} BenchAsm;
+
+static inline uint16_t encR(int funct4, int rs2, int rd, int funct3) {
+    return (funct4 << 12) | (rs2 << 9) | (rd << 6) | (funct3 << 3) | 0;
+}
+static inline uint16_t encI(int imm, int rd, int funct3) {
+    return ((imm & 0x7F) << 9) | (rd << 6) | (funct3 << 3) | 1;
+}
+static inline uint16_t encB(int offset, int rs1, int rs2, int funct3) {
+    return (((offset >> 1) & 0xF) << 12) | (rs2 << 9) | (rs1 << 6) | (funct3 << 3) | 2;
+}
+static inline uint16_t encS(int offset, int rs1, int rs2, int funct3) {
+    return ((offset & 0xF) << 12) | (rs2 << 9) | (rs1 << 6) | (funct3 << 3) | 3;
+}
+static inline uint16_t encL(int offset, int rd, int rs2, int funct3) {
+    return ((offset & 0xF) << 12) | (rs2 << 9) | (rd << 6) | (funct3 << 3) | 4;
+}
+static inline uint16_t encJ(int offset, int rd, int link) {
+    return (link << 15) | (((offset >> 4) & 0x3F) << 9) | (rd << 6) | (((offset >> 1) & 7) << 3) | 5;
+}
+static inline uint16_t encU(int imm, int rd, int auipc) {
+    return (auipc << 15) | (((imm >> 10) & 0x3F) << 9) | (rd << 6) | (((imm >> 7) & 7) << 3) | 6;
+}
+
+static inline void benchPut(BenchAsm *a, uint16_t word) { a->words[a->n++] = word; }
+static inline int byteOffset(BenchAsm *a, int target) { return (target - a->n) * 2; }
+
+static void benchAluBody(BenchAsm *a) {
+    benchPut(a, encR(0, X_A1, X_A0, 0));   // add a0, a1
+    benchPut(a, encI(5, X_A1, 0));         // addi a1, 5
+    benchPut(a, encR(9, X_A0, X_T0, 6));   // xor t0, a0
+    benchPut(a, encI(0x10 | 3, X_T0, 3));  // slli t0, 3
+    benchPut(a, encR(1, X_T0, X_RA, 0));   // sub ra, t0
+    benchPut(a, encR(7, X_RA, X_T1, 4));   // or t1, ra
+    benchPut(a, encR(8, X_A1, X_T1, 5));   // and t1, a1
+    benchPut(a, encI(0x20 | 2, X_T1, 3));  // srli t1, 2
+    benchPut(a, encR(2, X_T1, X_RA, 1));   // slt ra, t1
+    benchPut(a, encR(0, X_T1, X_A0, 0));   // add a0, t1
+    benchPut(a, encI(-3, X_A0, 0));        // addi a0, -3
+    benchPut(a, encR(10, X_A0, X_T0, 7));  // mv t0, a0
+}
+
+// A 16-bit xorshift in a0 drives four branches per iteration, so about half of them
+// are taken at random.
+static void benchBranchSetup(BenchAsm *a) {
+    benchPut(a, encI(1, X_A0, 7));         // li a0, 1
+}
+static void benchBranchBody(BenchAsm *a) {
+    benchPut(a, encR(10, X_A0, X_T1, 7));  // mv t1, a0
+    benchPut(a, encI(0x10 | 7, X_T1, 3));  // slli t1, 7
+    benchPut(a, encR(9, X_T1, X_A0, 6));   // xor a0, t1
+    benchPut(a, encR(10, X_A0, X_T1, 7));  // mv t1, a0
+    benchPut(a, encI(0x20 | 9, X_T1, 3));  // srli t1, 9
+    benchPut(a, encR(9, X_T1, X_A0, 6));   // xor a0, t1
+    benchPut(a, encR(10, X_A0, X_T1, 7));  // mv t1, a0
+    benchPut(a, encI(0x10 | 8, X_T1, 3));  // slli t1, 8
+    benchPut(a, encR(9, X_T1, X_A0, 6));   // xor a0, t1
+    for (int bit = 1; bit <= 8; bit <<= 1) {
+        benchPut(a, encR(10, X_A0, X_T1, 7));      // mv t1, a0
+        benchPut(a, encI(bit, X_T1, 5));           // andi t1, bit
+        benchPut(a, encB(4, X_T1, X_T0, bit & 5 ? 2 : 3)); // bz/bnz t1, +4
+        benchPut(a, encI(1, bit & 3 ? X_T0 : X_RA, 0));    // addi t0/ra, 1
+    }
+}
+
+// Streams through the 32 KB from 0x8000 to the end of memory, eight bytes per iteration.
+#define BENCH_STREAM_ITERS 4096
+static void benchStreamSetup(BenchAsm *a) {
+    benchPut(a, encU(0x8000, X_SP, 0));    // lui sp, 0x8000
+}
+static void benchStreamBody(BenchAsm *a) {
+    benchPut(a, encL(0, X_T0, X_SP, 1));   // lw t0, 0(sp)
+    benchPut(a, encL(2, X_T1, X_SP, 1));   // lw t1, 2(sp)
+    benchPut(a, encR(0, X_T1, X_T0, 0));   // add t0, t1
+    benchPut(a, encS(4, X_SP, X_T0, 1));   // sw t0, 4(sp)
+    benchPut(a, encL(6, X_A0, X_SP, 4));   // lbu a0, 6(sp)
+    benchPut(a, encR(9, X_T0, X_A0, 6));   // xor a0, t0
+    benchPut(a, encS(6, X_SP, X_A0, 0));   // sb a0, 6(sp)
+    benchPut(a, encI(8, X_SP, 0));         // addi sp, 8
+}
+
+// Calls a leaf function and a function that saves ra on a stack below 0xF000 and calls
+// the leaf. The functions sit at 'benchFunctions', ahead of the loops.
+static int benchLeaf, benchNested;
+static void benchCallSetup(BenchAsm *a) {
+    benchPut(a, encU(0xF000, X_SP, 0));    // lui sp, 0xF000
+}
+static void benchCallFunctions(BenchAsm *a) {
+    benchLeaf = a->n;
+    benchPut(a, encI(1, X_A0, 0));         // addi a0, 1
+    benchPut(a, encR(11, 0, X_RA, 0));     // jr ra
+    benchNested = a->n;
+    benchPut(a, encI(-2, X_SP, 0));        // addi sp, -2
+    benchPut(a, encS(0, X_SP, X_RA, 1));   // sw ra, 0(sp)
+    benchPut(a, encJ(byteOffset(a, benchLeaf), X_RA, 1)); // jal ra, leaf
+    benchPut(a, encL(0, X_RA, X_SP, 1));   // lw ra, 0(sp)
+    benchPut(a, encI(2, X_SP, 0));         // addi sp, 2
+    benchPut(a, encR(11, 0, X_RA, 0));     // jr ra
+}
+static void benchCallBody(BenchAsm *a) {
+    benchPut(a, encJ(byteOffset(a, benchLeaf), X_RA, 1));   // jal ra, leaf
+    benchPut(a, encJ(byteOffset(a, benchNested), X_RA, 1)); // jal ra, nested
+    benchPut(a, encJ(byteOffset(a, benchLeaf), X_RA, 1));   // jal ra, leaf
+    benchPut(a, encR(10, X_A0, X_T0, 7));                   // mv t0, a0
+}
+
+#define BENCH_ECALL_ITERS 4096
+static void benchEcallBody(BenchAsm *a) {
+    benchPut(a, encI(7, X_A0, 0));         // addi a0, 7
+    benchPut(a, (1 << 6) | 7);             // ecall 1 (print a0)
+    benchPut(a, encR(10, X_A0, X_T0, 7));  // mv t0, a0
+    benchPut(a, (1 << 6) | 7);             // ecall 1
+}
+
+typedef struct {
+    const char *name;
+    int outer; // outer passes at --bench-scale=1
+    int inner; // iterations per outer pass: 128..32768 in steps of 128
+    void (*setup)(BenchAsm *a);
+    void (*body)(BenchAsm *a);
+    void (*functions)(BenchAsm *a);
+} BenchWorkload;
+
+static const BenchWorkload benchWorkloads[] = {
+    {"alu",    32,  32768,              NULL,             benchAluBody,    NULL},
+    {"branch", 32,  16384,              benchBranchSetup, benchBranchBody, NULL},
+    {"stream", 128, BENCH_STREAM_ITERS, benchStreamSetup, benchStreamBody, NULL},
+    {"call",   32,  16384,              benchCallSetup,   benchCallBody,   benchCallFunctions},
+    {"ecall",  32,  BENCH_ECALL_ITERS,  NULL,             benchEcallBody,  NULL},
+};
+
+// Builds the program for 'w' with 'outer' outer passes (at most BENCH_MAX_OUTER) into 'a'.
+static void buildBenchWorkload(const BenchWorkload *w, int outer, BenchAsm *a) {
+    a->n = 0;
+    if (w->functions) {
+        benchPut(a, 0); // j over the functions, patched below
+        w->functions(a);
+        a->words[0] = encJ(a->n * 2, X_T0, 0);
+    }
+    benchPut(a, encU(outer << 7, X_S0, 0));     // lui s0, outer << 7
+    benchPut(a, encI(0x20 | 7, X_S0, 3));       // srli s0, 7
+    int outerHead = a->n;
+    benchPut(a, encU(w->inner, X_S1, 0));       // lui s1, inner
+    if (w->setup)
+        w->setup(a);
+    int innerHead = a->n;
+    w->body(a);
+    benchPut(a, encI(-1, X_S1, 0));             // addi s1, -1
+    benchPut(a, encB(4, X_S1, X_T0, 2));        // bz s1, +4
+    benchPut(a, encJ(byteOffset(a, innerHead), X_T0, 0));
+    benchPut(a, encI(-1, X_S0, 0));             // addi s0, -1
+    benchPut(a, encB(4, X_S0, X_T0, 2));        // bz s0, +4
+    benchPut(a, encJ(byteOffset(a, outerHead), X_T0, 0));
+    benchPut(a, (3 << 6) | 7);                  // ecall 3
+}
+
+static void countOutput(Z16Machine *m, const char *data, size_t len) {
+    (void)data;
+    *(uint64_t *)m->outputCtx += len;
+}
+
+static inline uint64_t readCycles(void) {
+#if Z16_TSC
+    return __rdtsc();
+#else
+    return 0;
+#endif
+}
+
+typedef struct {
+    uint64_t instret;
+    double seconds;
+    uint64_t cycles;
+} BenchResult;
+
+static BenchResult runBenchOnce(Z16Machine *m, const BenchAsm *a, int engine) {
+    resetMachine(m);
+    memset(m->memory, 0, MEM_SIZE);
+    memcpy(m->memory, a->words, a->n * sizeof(uint16_t));
+
+    BenchResult r;
+    auto start = std::chrono::steady_clock::now();
+    uint64_t startCycles = readCycles();
+    runEngine(m, engine);
+    r.cycles = readCycles() - startCycles;
+    r.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    r.instret = m->instret;
+    return r;
+}
+
+// Runs every workload on every engine and prints a table; with 'jsonPath', also writes
+// the results as JSON. Returns 1 if the engines disagreed on an instruction count.
+int runBenchmarks(int scale, int jitThreshold, const char *jsonPath) {
+    FILE *json = NULL;
+    if (jsonPath && !(json = fopen(jsonPath, "w"))) {
+        perror("Error opening benchmark JSON file");
+        return 1;
+    }
+
+    Z16Machine *m = createMachine();
+    uint64_t outputBytes = 0;
+    m->output = countOutput;
+    m->outputCtx = &outputBytes;
+    m->jitThreshold = jitThreshold;
+
+    int status = 0;
+    int first = 1;
+    printf("%-8s %-10s %12s %10s %9s %11s\n", "workload", "engine", "instructions", "MIPS",
+           "ns/inst", "cycles/inst");
+    if (json)
+        fprintf(json, "{\n  \"scale\": %d,\n  \"tsc\": %s,\n  \"results\": [", scale,
+                Z16_TSC ? "true" : "false");
+
+    static BenchAsm a;
+    for (const BenchWorkload &w : benchWorkloads) {
+        int outer = w.outer * scale;
+        buildBenchWorkload(&w, outer < BENCH_MAX_OUTER ? outer : BENCH_MAX_OUTER, &a);
+        uint64_t expected = 0;
+        for (int engine = 0; engine < (int)(sizeof(engineNames) / sizeof(engineNames[0])); engine++) {
+            BenchResult best = runBenchOnce(m, &a, engine);
+            for (int i = 1; i < BENCH_REPEAT; i++) {
+                BenchResult r = runBenchOnce(m, &a, engine);
+                if (r.seconds < best.seconds)
+                    best = r;
+            }
+            if (engine == 0)
+                expected = best.instret;
+            if (best.instret != expected || m->exitReason != EXIT_HALT) {
+                fprintf(stderr, "bench: %s on %s stopped (%s) after %llu instructions, reference %llu\n",
+                        w.name, engineNames[engine], exitNames[m->exitReason],
+                        (unsigned long long)best.instret, (unsigned long long)expected);
+                status = 1;
+            }
+
+            double mips = best.instret / best.seconds / 1e6;
+            double nsPerInst = best.seconds * 1e9 / best.instret;
+            double cyclesPerInst = (double)best.cycles / best.instret;
+            printf("%-8s %-10s %12llu %10.1f %9.3f ", w.name, engineNames[engine],
+                   (unsigned long long)best.instret, mips, nsPerInst);
+            if (Z16_TSC)
+                printf("%11.2f\n", cyclesPerInst);
+            else
+                printf("%11s\n", "-");
+            if (json) {
+                fprintf(json, "%s\n    {\"workload\": \"%s\", \"engine\": \"%s\", \"instructions\": %llu, "
+                              "\"seconds\": %.6f, \"mips\": %.3f, \"ns_per_inst\": %.4f, ",
+                        first ? "" : ",", w.name, engineNames[engine],
+                        (unsigned long long)best.instret, best.seconds, mips, nsPerInst);
+                if (Z16_TSC)
+                    fprintf(json, "\"cycles_per_inst\": %.4f}", cyclesPerInst);
+                else
+                    fprintf(json, "\"cycles_per_inst\": null}");
+                first = 0;
+            }
+            fflush(stdout);
+        }
+    }
+
+    if (json) {
+        fprintf(json, "\n  ]\n}\n");
+        fclose(json);
+    }
+    destroyMachine(m);
+    return status;
+}
+
+// -----------------------
+// Main Simulation Loop
+// -----------------------
+
+#if !defined(Z16_LIBFUZZER) // libFuzzer supplies main
+// Program input comes from stdin.
+static uint16_t readFromStdin(Z16Machine *m, int source) {
+    (void)m;
+    (void)source;
+    int c = getchar();
+    return c == EOF ? 0xFFFF : (uint16_t)c;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [--engine=reference|threaded|block|jit] [--jit-threshold=N] "
+                    "[--no-fusion] [--fusion-stats] [--inst-limit=N] [--trace=none|pc|disasm|full] "
+                    "[--trace-file=PATH] [--profile[=PATH]] [--flamegraph=PATH [--flamegraph-period=N] "
+                    "[--symbols=PATH]] [--icache=SPEC] [--dcache=SPEC] [--l2cache=SPEC] "
+                    "[--bpred=static|bimodal|gshare[:N[:H]] [--btb=N] [--ras=N]] [--timing[=PATH]] "
+                    "[--restore=PATH] [--save-snapshot=PATH] [--page-size=N] [--coverage=PATH] "
+                    "[--coverage-report[=PATH]] [--line-map=PATH --lcov=PATH] [--record=PATH|--replay=PATH] "
+                    "[--debug[=PATH] [--checkpoint-interval=N] [--checkpoint-memory=SIZE]] "
+                    "[--verify] <machine_code_file>\n"
+                    "       %s [--engine=...] [--jit-threshold=N] [--inst-limit=N] [--jobs=N] "
+                    "[--batch-out=PATH] [--coverage=...] --batch <manifest>\n"
+                    "       %s [--jit-threshold=N] [--bench-scale=N] [--bench-json=PATH] --bench\n"
+                    "       %s [--inst-limit=N] [--fuzz-entry=ADDR] [--fuzz-buffer=ADDR] [--fuzz-max-len=N] "
+                    "--fuzz <image> [input...]\n"
+                    "       %s [--coverage=PATH] [--coverage-report[=PATH]] [--line-map=PATH --lcov=PATH] "
+                    "--coverage-merge <image> <coverage_file...>\n"
+                    "       %s --decode-trace <binary_trace_file>\n", prog, prog, prog, prog, prog, prog);
+    exit(1);
+}
+
+int main(int argc, char **argv) {
+    const char *filename = NULL;
+    int engine = ENGINE_REFERENCE;
+    int traceLevel = -1; // default: disasm for the reference engine, none otherwise
+    const char *traceFile = NULL;
+    int verify = 0;
+    int jitThreshold = 50;
+    uint64_t instLimit = 0;
+    const char *batchManifest = NULL;
+    const char *batchOut = NULL;
+    int jobs = 0; // 0: one worker per hardware thread
+    int fuse = 1;
+    int profile = 0;
+    const char *profileOut = NULL; // NULL: report to stderr
+    const char *flamegraphOut = NULL;
+    uint64_t flamegraphPeriod = 1;
+    const char *symbolMap = NULL;
+    const char *icache = NULL, *dcache = NULL, *l2cache = NULL;
+    const char *bpred = NULL;
+    unsigned long btbEntries = 64, rasDepth = 8;
+    int timing = 0;
+    const char *timingConfig = NULL; // NULL: default latencies
+    const char *restoreFrom = NULL;
+    const char *saveSnapshot = NULL;
+    uint32_t pageSize = DIRTY_PAGE_MIN;
+    int fuzz = 0;
+    unsigned long fuzzEntry = 0, fuzzBuffer = 0x8000, fuzzMaxLen = FUZZ_DEFAULT_MAX_LEN;
+    const char *coverageOut = NULL;
+    const char *coverageReport = NULL; // "": report to stderr
+    const char *lineMap = NULL;
+    const char *lcovOut = NULL;
+    int coverageMerge = 0;
+    const char *recordTo = NULL;
+    const char *replayFrom = NULL;
+    int debug = 0;
+    const char *debugCommands = NULL; // NULL: stdin
+    uint64_t checkpointInterval = DEBUG_CHECKPOINT_INTERVAL;
+    unsigned long checkpointMemory = DEBUG_CHECKPOINT_MEMORY;
+    int fusionStats = 0;
+    int bench = 0;
+    int benchScale = 1;
+    const char *benchJson = NULL;
+
+    if (argc == 3 && strcmp(argv[1], "--decode-trace") == 0)
+        return decodeTraceFile(argv[2]);
+
+    for (int i = 1; i < argc; i++) {
+        if (strncmp(argv[i], "--engine=", 9) == 0) {
+            engine = lookupName(argv[i] + 9, engineNames, sizeof(engineNames) / sizeof(engineNames[0]));
+            if (engine < 0)
+                usage(argv[0]);
+        } else if (strncmp(argv[i], "--trace=", 8) == 0) {
+            traceLevel = lookupName(argv[i] + 8, traceNames, sizeof(traceNames) / sizeof(traceNames[0]));
+            if (traceLevel < 0)
+                usage(argv[0]);
+        } else if (strncmp(argv[i], "--jit-threshold=", 16) == 0) {
+            jitThreshold = atoi(argv[i] + 16);
+            if (jitThreshold < 1)
+                usage(argv[0]);
+        } else if (strncmp(argv[i], "--trace-file=", 13) == 0) {
+            traceFile = argv[i] + 13;
+        } else if (strcmp(argv[i], "--verify") == 0) {
+            verify = 1;
+        } else if (strncmp(argv[i], "--inst-limit=", 13) == 0) {
+            instLimit = strtoull(argv[i] + 13, NULL, 0);
+        } else if (strcmp(argv[i], "--batch") == 0 && i + 1 < argc) {
+            batchManifest = argv[++i];
+        } else if (strncmp(argv[i], "--batch-out=", 12) == 0) {
+            batchOut = argv[i] + 12;
+        } else if (strcmp(argv[i], "--profile") == 0) {
+            profile = 1;
+        } else if (strncmp(argv[i], "--profile=", 10) == 0) {
+            profile = 1;
+            profileOut = argv[i] + 10;
+        } else if (strncmp(argv[i], "--flamegraph=", 13) == 0) {
+            flamegraphOut = argv[i] + 13;
+        } else if (strncmp(argv[i], "--flamegraph-period=", 20) == 0) {
+            flamegraphPeriod = strtoull(argv[i] + 20, NULL, 0);
+            if (flamegraphPeriod < 1)
+                usage(argv[0]);
+        } else if (strncmp(argv[i], "--symbols=", 10) == 0) {
+            symbolMap = argv[i] + 10;
+        } else if (strncmp(argv[i], "--icache=", 9) == 0) {
+            icache = argv[i] + 9;
+        } else if (strncmp(argv[i], "--dcache=", 9) == 0) {
+            dcache = argv[i] + 9;
+        } else if (strncmp(argv[i], "--l2cache=", 10) == 0) {
+            l2cache = argv[i] + 10;
+        } else if (strncmp(argv[i], "--bpred=", 8) == 0) {
+            bpred = argv[i] + 8;
+        } else if (strncmp(argv[i], "--btb=", 6) == 0) {
+            btbEntries = strtoul(argv[i] + 6, NULL, 0);
+        } else if (strncmp(argv[i], "--ras=", 6) == 0) {
+            rasDepth = strtoul(argv[i] + 6, NULL, 0);
+        } else if (strcmp(argv[i], "--timing") == 0) {
+            timing = 1;
+        } else if (strncmp(argv[i], "--timing=", 9) == 0) {
+            timing = 1;
+            timingConfig = argv[i] + 9;
+        } else if (strncmp(argv[i], "--restore=", 10) == 0) {
+            restoreFrom = argv[i] + 10;
+        } else if (strncmp(argv[i], "--save-snapshot=", 16) == 0) {
+            saveSnapshot = argv[i] + 16;
+        } else if (strncmp(argv[i], "--page-size=", 12) == 0) {
+            pageSize = (uint32_t)strtoul(argv[i] + 12, NULL, 0);
+            if (pageSize < DIRTY_PAGE_MIN || pageSize > DIRTY_PAGE_MAX || (pageSize & (pageSize - 1)))
+                usage(argv[0]);
+        } else if (strcmp(argv[i], "--fuzz") == 0 && i + 1 < argc) {
+            fuzz = i + 1; // the image, then input files
+            break;
+        } else if (strncmp(argv[i], "--fuzz-entry=", 13) == 0) {
+            fuzzEntry = strtoul(argv[i] + 13, NULL, 0);
+        } else if (strncmp(argv[i], "--fuzz-buffer=", 14) == 0) {
+            fuzzBuffer = strtoul(argv[i] + 14, NULL, 0);
+        } else if (strncmp(argv[i], "--fuzz-max-len=", 15) == 0) {
+            fuzzMaxLen = strtoul(argv[i] + 15, NULL, 0);
+        } else if (strcmp(argv[i], "--debug") == 0) {
+            debug = 1;
+        } else if (strncmp(argv[i], "--debug=", 8) == 0) {
+            debug = 1;
+            debugCommands = argv[i] + 8;
+        } else if (strncmp(argv[i], "--checkpoint-interval=", 22) == 0) {
+            checkpointInterval = strtoull(argv[i] + 22, NULL, 0);
+            if (checkpointInterval < 1)
+                usage(argv[0]);
+        } else if (strncmp(argv[i], "--checkpoint-memory=", 20) == 0) {
+            char *end;
+            checkpointMemory = parseSize(argv[i] + 20, &end);
+            if (*end || checkpointMemory < 1)
+                usage(argv[0]);
+        } else if (strncmp(argv[i], "--record=", 9) == 0) {
+            recordTo = argv[i] + 9;
+        } else if (strncmp(argv[i], "--replay=", 9) == 0) {
+            replayFrom = argv[i] + 9;
+        } else if (strncmp(argv[i], "--coverage=", 11) == 0) {
+            coverageOut = argv[i] + 11;
+        } else if (strcmp(argv[i], "--coverage-report") == 0) {
+            coverageReport = "";
+        } else if (strncmp(argv[i], "--coverage-report=", 18) == 0) {
+            coverageReport = argv[i] + 18;
+        } else if (strncmp(argv[i], "--line-map=", 11) == 0) {
+            lineMap = argv[i] + 11;
+        } else if (strncmp(argv[i], "--lcov=", 7) == 0) {
+            lcovOut = argv[i] + 7;
+        } else if (strcmp(argv[i], "--coverage-merge") == 0 && i + 2 < argc) {
+            coverageMerge = i + 1; // the image, then coverage files
+            break;
+        } else if (strcmp(argv[i], "--no-fusion") == 0) {
+            fuse = 0;
+        } else if (strcmp(argv[i], "--fusion-stats") == 0) {
+            fusionStats = 1;
+        } else if (strcmp(argv[i], "--bench") == 0) {
+            bench = 1;
+        } else if (strncmp(argv[i], "--bench-scale=", 14) == 0) {
+            benchScale = atoi(argv[i] + 14);
+            if (benchScale < 1)
+                usage(argv[0]);
+        } else if (strncmp(argv[i], "--bench-json=", 13) == 0) {
+            benchJson = argv[i] + 13;
+        } else if (strncmp(argv[i], "--jobs=", 7) == 0) {
+            jobs = atoi(argv[i] + 7);
+            if (jobs < 1)
+                usage(argv[0]);
+        } else if (argv[i][0] == '-' || filename) {
+            usage(argv[0]);
+        } else {
+            filename = argv[i];
+        }
+    }
+    int coverage = coverageOut || coverageReport || lcovOut;
+    if (!lcovOut != !lineMap || (recordTo && replayFrom))
+        usage(argv[0]);
+    if (debug && (traceLevel > TRACE_NONE || traceFile || profile || flamegraphOut || icache || dcache || l2cache ||
+                  bpred || timing || coverage || recordTo || verify || batchManifest || fuzz || coverageMerge))
+        usage(argv[0]); // the session moves back and forth; per-run outputs would not make sense
+    if (bench)
+        return runBenchmarks(benchScale, jitThreshold, benchJson);
+    if (coverageMerge) {
+        if (filename || !coverage)
+            usage(argv[0]);
+        return runCoverageMerge(argv[coverageMerge], argv + coverageMerge + 1, argc - coverageMerge - 1, coverageOut,
+                                coverageReport, lineMap, lcovOut);
+    }
+    if (fuzz) {
+        if (filename || fuzzEntry >= MEM_SIZE || fuzzBuffer >= MEM_SIZE || fuzzBuffer + fuzzMaxLen > MEM_SIZE)
+            usage(argv[0]);
+        return runFuzz(argv[fuzz], (uint16_t)fuzzEntry, (uint16_t)fuzzBuffer, (uint32_t)fuzzMaxLen,
+                       instLimit ? instLimit : FUZZ_DEFAULT_INST_LIMIT, argv + fuzz + 1, argc - fuzz - 1);
+    }
+    if (batchManifest) { // images come from the manifest; tracing, profiling and --verify do not apply
+        if (filename || traceLevel > TRACE_NONE || traceFile || profile || flamegraphOut || icache || dcache ||
+            l2cache || bpred || timing || restoreFrom || saveSnapshot || verify || recordTo || replayFrom)
+            usage(argv[0]);
+        Coverage *cov = coverage ? (Coverage *)calloc(1, sizeof(Coverage)) : NULL;
+        int status = runBatch(batchManifest, batchOut, jobs, engine, jitThreshold, instLimit, cov);
+        if (cov) // the images may differ, so nothing is disassembled
+            status |= writeCoverageOutputs(cov, NULL, 0, coverageOut, coverageReport, lineMap, lcovOut);
+        free(cov);
+        return status;
+    }
+    if (!filename)
+        usage(argv[0]);
+    if (traceLevel < 0)
+        traceLevel = engine == ENGINE_REFERENCE ? TRACE_DISASM : TRACE_NONE;
+    if (traceLevel != TRACE_NONE) { // trace lines are appended to a large stdout buffer
+        static char stdoutBuf[1 << 20];
+        setvbuf(stdout, stdoutBuf, _IOFBF, sizeof(stdoutBuf));
+    }
+
+    // Registers, PC and the decode cache start zeroed: execution begins at address 0
+    Z16Machine *m = createMachine();
+    m->jitThreshold = jitThreshold;
+    m->instLimit = instLimit;
+    m->fuse = fuse;
+    setDirtyPageSize(m, pageSize);
+    Z16Image *img = openImage(filename);
+    if (!img)
+        exit(1);
+    loadImage(m, img);
+    printf("Loaded %zu bytes into memory\n", img->size);
+    Z16Snapshot *start = NULL;
+    if (restoreFrom) {
+        if (!(start = readSnapshot(restoreFrom, img)))
+            exit(1);
+        restoreSnapshot(m, start);
+    }
+    FILE *commands = stdin;
+    if (debugCommands && !(commands = fopen(debugCommands, "r"))) {
+        perror("Error opening debugger commands");
+        exit(1);
+    }
+    // With debugger commands on stdin, the program reads input only from --replay
+    m->input = debug && commands == stdin ? NULL : readFromStdin;
+    InputLog *inputLog = NULL;
+    if (replayFrom) {
+        if (!(inputLog = readInputLog(replayFrom, img)))
+            exit(1);
+        if (inputLog->header.startInstret != m->instret) {
+            fprintf(stderr, "Error: the replay log starts at instruction %llu (restore the snapshot it was "
+                            "recorded from)\n", (unsigned long long)inputLog->header.startInstret);
+            exit(1);
+        }
+        if (!instLimit && inputLog->header.exitReason == EXIT_INST_LIMIT)
+            m->instLimit = inputLog->header.endInstret;
+        startReplay(m, inputLog);
+    } else if (recordTo || verify) { // --verify reruns the program on the same input
+        inputLog = startRecording(m, img);
+    }
+
+    if (traceFile && !(m->trace = openTraceWriter(traceFile)))
+        exit(1);
+    if (profile)
+        m->profile = (Profile *)calloc(1, sizeof(Profile));
+    if (coverage)
+        m->coverage = (Coverage *)calloc(1, sizeof(Coverage));
+    if (flamegraphOut && !(m->calls = openCallStacks(m->pc, flamegraphPeriod, symbolMap)))
+        exit(1);
+    if (icache || dcache || l2cache) {
+        Observer *caches = createCacheModel(icache, dcache, l2cache);
+        if (!caches)
+            exit(1);
+        attachObserver(m, caches);
+    }
+    if (bpred) {
+        Observer *branches = createBranchModel(bpred, btbEntries, rasDepth);
+        if (!branches)
+            exit(1);
+        attachObserver(m, branches);
+    }
+    if (timing) { // last, so it sees what the cache and branch models recorded
+        Observer *timer = createTimingModel(timingConfig);
+        if (!timer)
+            exit(1);
+        attachObserver(m, timer);
+        m->latencies = timingLatencies(timer);
+    }
+
+    if (debug) {
+        runDebugger(m, img, engine, commands, checkpointInterval, checkpointMemory);
+        if (commands != stdin)
+            fclose(commands);
+    } else if (traceLevel != TRACE_NONE || m->trace || m->profile || m->calls || m->observers || m->coverage) {
+        // Tracing, profiling, models and coverage need a per-instruction hook: every engine runs them
+        // through the stepping loop.
+        runStepping(m, traceLevel);
+    } else {
+        runEngine(m, engine);
+    }
+    if (m->exitReason == EXIT_INST_LIMIT) {
+        fflush(stdout);
+        fprintf(stderr, "Stopped at the instruction limit (%llu instructions)\n",
+                (unsigned long long)m->instret);
+    }
+    int status = 0;
+    if (replayFrom) { // a debugging session may stop anywhere in the recorded run
+        fflush(stdout);
+        status = finishReplay(m, inputLog, debug) || debug ? 0 : 1;
+    } else if (inputLog) {
+        stopRecording(m, inputLog);
+    }
+    if (fusionStats) {
+        fflush(stdout);
+        printFusionStats(m);
+    }
+    if (m->profile) {
+        FILE *out = profileOut ? fopen(profileOut, "w") : stderr;
+        if (!out) {
+            perror("Error opening profile report");
+        } else {
+            fflush(stdout);
+            writeProfileReport(m, out);
+            if (out != stderr)
+                fclose(out);
+        }
+        free(m->profile);
+        m->profile = NULL;
+    }
+    if (m->calls) {
+        FILE *out = fopen(flamegraphOut, "w");
+        if (!out) {
+            perror("Error opening flamegraph output");
+        } else {
+            writeFoldedStacks(m->calls, out);
+            fclose(out);
+        }
+        closeCallStacks(m->calls);
+        m->calls = NULL;
+    }
+    if (m->observers) {
+        fflush(stdout);
+        m->latencies = NULL;
+        closeObservers(m, stderr);
+    }
+
+    if (m->trace) {
+        closeTraceWriter(m->trace);
+        m->trace = NULL;
+    }
+
+    if (recordTo)
+        status |= writeInputLog(inputLog, recordTo);
+    if (m->coverage)
+        status |= writeCoverageOutputs(m->coverage, img->data, img->size, coverageOut, coverageReport, lineMap,
+                                       lcovOut);
+    if (saveSnapshot) {
+        Z16Snapshot *snap = takeSnapshot(m, img);
+        status |= writeSnapshot(snap, saveSnapshot);
+        freeSnapshot(snap);
+    }
+    if (verify) {
+        fflush(stdout);
+        if (inputLog)
+            startReplay(m, inputLog);
+        status |= verifyAgainstReference(m, img, start, engineNames[engine]) ? 0 : 1;
+        if (inputLog)
+            finishReplay(m, inputLog, 1); // any difference shows up in the comparison
+    }
+    if (inputLog)
+        freeInputLog(inputLog);
+    if (start)
+        freeSnapshot(start);
+    destroyMachine(m);
+    closeImage(img);
+    return status;
 }
+#endif